@@ -0,0 +1,841 @@
+/*
+A benchmark that runs the same allocation workloads on my_malloc and on the system's (glibc's)
+malloc and compares them. Build it with:
+
+	gcc -O2 -DMY_MALLOC_THREADS -o bench bench.c mymalloc.c -lpthread -lm
+
+(add -DMY_MALLOC_NUMA for a heap per NUMA node, -DMY_MALLOC_HUGEPAGES for huge pages) and run it
+like:
+
+	./bench [-n num_ops] [-s seed] [workload or trace file]...
+
+The workloads are uniform, powerlaw, churn and prodcons, and it runs all of them if none are
+given. Anything else is read as a trace file, like the ones my_malloc_trace_start writes. A seed
+always makes the same workloads, so two runs see exactly the same calls.
+
+The hardening checks are picked when mymalloc.c is built, so to see what each one costs, build
+the benchmark once per check and compare the runs; the first line says which checks it has:
+
+	for checks in "" -DMY_MALLOC_SAFE_LINKS -DMY_MALLOC_DOUBLE_FREE_CHECKS \
+		-DMY_MALLOC_BOUNDS_CHECKS -DMY_MALLOC_HARDENED; do
+		gcc -O2 -DMY_MALLOC_THREADS $checks -o bench bench.c mymalloc.c -lpthread -lm && ./bench
+	done
+
+The same goes for the configuration headers (see mymalloc.h), to compare deployments; the first
+line also says which one it was built with:
+
+	for config in embedded server hardened; do
+		gcc -O2 -DMY_MALLOC_CONFIG="\"config_$config.h\"" -o bench bench.c mymalloc.c \
+			-lpthread -lm && ./bench
+	done
+
+Every run gets a forked process of its own, so neither allocator sees the other's heap and the
+peak RSS is just that run's (less what the process started with). Each call is timed with
+clock_gettime, less what reading the clock costs. Trace files are replayed on one thread, in
+timestamp order.
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mymalloc.h"
+#include "mytrace.h"
+
+/*Blocks are touched once per this many bytes, so they count toward the RSS.*/
+#define TOUCH_STRIDE 4096
+
+/*How many blocks the producer in prodcons can get ahead of the consumer.*/
+#define QUEUE_SIZE 1024
+
+/*A slot that nothing is in.*/
+#define NO_SLOT 0xFFFFFFFF
+
+/*One call in a workload. Blocks live in numbered slots, so replaying doesn't
+have to look pointers up.*/
+typedef struct Op
+{
+	uint32_t size;
+	uint32_t slot; /*Where the result goes, or what to realloc or free.*/
+	uint8_t op;    /*One of the MY_TRACE_* ops.*/
+} Op;
+
+typedef struct Workload
+{
+	const char* name;
+	Op* ops;
+	unsigned int num_ops;
+	unsigned int num_slots;
+	int threaded; /*1 for prodcons, whose ops are all mallocs for the producer.*/
+} Workload;
+
+typedef struct Allocator
+{
+	const char* name;
+	void* (*malloc)(unsigned int size);
+	void* (*calloc)(unsigned int nmemb, unsigned int size);
+	void* (*realloc)(void* ptr, unsigned int size);
+	void (*free)(void* ptr);
+	int thread_safe;
+	int is_mine; /*1 if my_heap_summarize knows about its heap.*/
+} Allocator;
+
+void* system_malloc(unsigned int size)
+{
+	return malloc(size);
+}
+
+void* system_calloc(unsigned int nmemb, unsigned int size)
+{
+	return calloc(nmemb, size);
+}
+
+void* system_realloc(void* ptr, unsigned int size)
+{
+	return realloc(ptr, size);
+}
+
+void system_free(void* ptr)
+{
+	free(ptr);
+}
+
+Allocator allocators[] =
+{
+#ifdef MY_MALLOC_THREADS
+	{"my_malloc", my_malloc, my_calloc, my_realloc, my_free, 1, 1},
+#else
+	{"my_malloc", my_malloc, my_calloc, my_realloc, my_free, 0, 1},
+#endif
+	{"glibc", system_malloc, system_calloc, system_realloc, system_free, 1, 0},
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/*The hardening checks mymalloc.c was built with, the same way it works them out.*/
+#if defined(MY_MALLOC_HARDENED) || defined(MY_MALLOC_SAFE_LINKS)
+#define SAFE_LINKS_NAME " safe-links"
+#else
+#define SAFE_LINKS_NAME ""
+#endif
+
+#if defined(MY_MALLOC_HARDENED) || defined(MY_MALLOC_DOUBLE_FREE_CHECKS)
+#define DOUBLE_FREE_NAME " double-free"
+#else
+#define DOUBLE_FREE_NAME ""
+#endif
+
+#if defined(MY_MALLOC_HARDENED) || defined(MY_MALLOC_BOUNDS_CHECKS)
+#define BOUNDS_NAME " bounds"
+#else
+#define BOUNDS_NAME ""
+#endif
+
+#define HARDENING_CHECKS SAFE_LINKS_NAME DOUBLE_FREE_NAME BOUNDS_NAME
+
+/*The configuration header mymalloc.c was built with, if any.*/
+#ifndef MY_MALLOC_CONFIG_NAME
+#define MY_MALLOC_CONFIG_NAME "none"
+#endif
+
+/*What reading the clock costs, taken off every sample.*/
+uint64_t timer_overhead;
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*The least time two back to back clock reads ever take.*/
+uint64_t measure_timer_overhead()
+{
+	uint64_t least = UINT64_MAX;
+	int i;
+
+	for(i = 0; i < 10000; i++)
+	{
+		uint64_t start = now_ns();
+		uint64_t elapsed = now_ns() - start;
+
+		if(elapsed < least)
+			least = elapsed;
+	}
+
+	return least;
+}
+
+uint32_t time_since(uint64_t start)
+{
+	uint64_t elapsed = now_ns() - start;
+
+	return elapsed > timer_overhead ? (uint32_t)(elapsed - timer_overhead) : 0;
+}
+
+/*A plain xorshift64*, so every platform makes the same workloads from a seed.*/
+uint64_t random_state;
+
+uint64_t random_next()
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+
+	return random_state * 2685821657736338717ULL;
+}
+
+unsigned int random_below(unsigned int n)
+{
+	return (unsigned int)(random_next() % n);
+}
+
+/*Uniform on [0, 1).*/
+double random_unit()
+{
+	return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+unsigned int uniform_size()
+{
+	return 16 + random_below(4096 - 16 + 1);
+}
+
+/*Pareto distributed from 8 bytes: mostly tiny blocks, but now and then a
+really big one, up to 1 MiB.*/
+unsigned int power_law_size()
+{
+	double size = 8.0 / pow(1.0 - random_unit(), 1.0 / 1.2);
+
+	return size < 1024 * 1024 ? (unsigned int)size : 1024 * 1024;
+}
+
+unsigned int small_size()
+{
+	return 16 + random_below(512 - 16 + 1);
+}
+
+void add_op(Workload* w, uint8_t op, uint32_t size, uint32_t slot)
+{
+	Op* o = &w->ops[w->num_ops++];
+
+	o->op = op;
+	o->size = size;
+	o->slot = slot;
+}
+
+void start_workload(Workload* w, const char* name, unsigned int num_ops, unsigned int num_slots)
+{
+	w->name = name;
+	w->ops = malloc(sizeof(Op) * num_ops);
+	w->num_ops = 0;
+	w->num_slots = num_slots;
+	w->threaded = 0;
+}
+
+/*Picks a random slot each step: an empty one gets allocated and a full one
+freed, or resized realloc_percent of the time. That keeps about half the
+slots live.*/
+void make_random_workload(Workload* w, const char* name, unsigned int num_ops,
+	unsigned int (*pick_size)(), unsigned int realloc_percent)
+{
+	unsigned int num_slots = 10000;
+	char* live = calloc(num_slots, 1);
+
+	start_workload(w, name, num_ops, num_slots);
+
+	while(w->num_ops < num_ops)
+	{
+		unsigned int slot = random_below(num_slots);
+
+		if(!live[slot])
+		{
+			add_op(w, MY_TRACE_MALLOC, pick_size(), slot);
+			live[slot] = 1;
+		}
+		else if(random_below(100) < realloc_percent)
+			add_op(w, MY_TRACE_REALLOC, pick_size(), slot);
+		else
+		{
+			add_op(w, MY_TRACE_FREE, 0, slot);
+			live[slot] = 0;
+		}
+	}
+
+	free(live);
+}
+
+void make_uniform(Workload* w, unsigned int num_ops)
+{
+	make_random_workload(w, "uniform", num_ops, uniform_size, 0);
+}
+
+void make_power_law(Workload* w, unsigned int num_ops)
+{
+	make_random_workload(w, "powerlaw", num_ops, power_law_size, 10);
+}
+
+/*Allocates a bunch of long-lived blocks up front, then churns through
+short-lived small ones, every so often swapping a long-lived block for one of
+a different size. The holes that leaves are what fragments the heap.*/
+void make_churn(Workload* w, unsigned int num_ops)
+{
+	unsigned int num_long = 16384, num_short = 1024;
+	char* live = calloc(num_short, 1);
+	unsigned int slot;
+
+	start_workload(w, "churn", num_ops, num_long + num_short);
+
+	for(slot = 0; slot < num_long && w->num_ops < num_ops; slot++)
+		add_op(w, MY_TRACE_MALLOC, 64 + random_below(1024 - 64 + 1), slot);
+
+	while(w->num_ops + 1 < num_ops)
+	{
+		if(random_below(100) == 0)
+		{
+			slot = random_below(num_long);
+			add_op(w, MY_TRACE_FREE, 0, slot);
+			add_op(w, MY_TRACE_MALLOC, 64 + random_below(1024 - 64 + 1), slot);
+			continue;
+		}
+
+		slot = random_below(num_short);
+
+		if(!live[slot])
+			add_op(w, MY_TRACE_MALLOC, small_size(), num_long + slot);
+		else
+			add_op(w, MY_TRACE_FREE, 0, num_long + slot);
+
+		live[slot] = !live[slot];
+	}
+
+	free(live);
+}
+
+/*One thread allocates small blocks and hands them to another that frees
+them, so every free is of a block some other thread allocated.*/
+void make_prodcons(Workload* w, unsigned int num_ops)
+{
+	start_workload(w, "prodcons", num_ops / 2, 0);
+	w->threaded = 1;
+
+	while(w->num_ops < num_ops / 2)
+		add_op(w, MY_TRACE_MALLOC, small_size(), 0);
+}
+
+/*Where load_trace keeps track of which slot each live address is in.*/
+typedef struct SlotEntry
+{
+	uint64_t address; /*0 if this entry is unused.*/
+	uint32_t slot;    /*NO_SLOT once the address is freed.*/
+} SlotEntry;
+
+/*Gives the entry for address, adding an empty one if there isn't one yet.*/
+SlotEntry* find_slot_entry(SlotEntry* table, uint64_t mask, uint64_t address)
+{
+	uint64_t i = (address * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+
+	while(table[i].address != 0 && table[i].address != address)
+		i = (i + 1) & mask;
+
+	if(table[i].address == 0)
+	{
+		table[i].address = address;
+		table[i].slot = NO_SLOT;
+	}
+
+	return &table[i];
+}
+
+const struct my_trace_record* sort_records;
+
+int compare_records(const void* a, const void* b)
+{
+	const struct my_trace_record* first = &sort_records[*(const uint32_t*)a];
+	const struct my_trace_record* second = &sort_records[*(const uint32_t*)b];
+
+	if(first->timestamp != second->timestamp)
+		return first->timestamp < second->timestamp ? -1 : 1;
+
+	return *(const uint32_t*)a < *(const uint32_t*)b ? -1 : 1;
+}
+
+/*Reads a trace file and turns it into a workload. Calls from before the trace
+started (frees of addresses it never saw allocated) are dropped, as are
+allocations that failed. Gives 0 if the file can't be read.*/
+int load_trace(Workload* w, const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	struct my_trace_header header;
+
+	if(file == NULL)
+		return 0;
+
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != MY_TRACE_MAGIC ||
+		header.version != MY_TRACE_VERSION || header.record_size != sizeof(struct my_trace_record))
+	{
+		fclose(file);
+		return 0;
+	}
+
+	struct my_trace_record* records = NULL;
+	unsigned int num_records = 0, capacity = 0;
+
+	for(;;)
+	{
+		if(num_records == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 65536;
+			records = realloc(records, sizeof(*records) * capacity);
+		}
+
+		if(fread(&records[num_records], sizeof(*records), 1, file) != 1)
+			break;
+
+		num_records++;
+	}
+
+	fclose(file);
+
+	uint32_t* order = malloc(sizeof(uint32_t) * (num_records + 1));
+	unsigned int i;
+
+	for(i = 0; i < num_records; i++)
+		order[i] = i;
+
+	sort_records = records;
+	qsort(order, num_records, sizeof(uint32_t), compare_records);
+
+	uint64_t table_size = 1;
+
+	while(table_size < 2 * (uint64_t)num_records + 2)
+		table_size *= 2;
+
+	SlotEntry* table = calloc(table_size, sizeof(SlotEntry));
+	uint32_t* free_slots = malloc(sizeof(uint32_t) * (num_records + 1));
+	unsigned int num_free_slots = 0;
+
+	start_workload(w, path, num_records + 1, 0);
+
+	for(i = 0; i < num_records; i++)
+	{
+		const struct my_trace_record* record = &records[order[i]];
+		SlotEntry* old_entry = NULL;
+		uint32_t slot;
+
+		if(record->op == MY_TRACE_FREE || (record->op == MY_TRACE_REALLOC && record->old_address))
+		{
+			if(record->op == MY_TRACE_FREE && record->address == 0)
+				continue;
+
+			old_entry = find_slot_entry(table, table_size - 1,
+				record->op == MY_TRACE_FREE ? record->address : record->old_address);
+
+			if(old_entry->slot == NO_SLOT)
+				old_entry = NULL;
+		}
+
+		if(record->op == MY_TRACE_FREE)
+		{
+			if(old_entry == NULL)
+				continue;
+
+			add_op(w, MY_TRACE_FREE, 0, old_entry->slot);
+			free_slots[num_free_slots++] = old_entry->slot;
+			old_entry->slot = NO_SLOT;
+			continue;
+		}
+
+		if(old_entry != NULL)
+		{
+			/*a realloc of a block we know about*/
+			slot = old_entry->slot;
+
+			if(record->address == 0 && record->size != 0)
+				continue;
+
+			add_op(w, MY_TRACE_REALLOC, record->size, slot);
+			old_entry->slot = NO_SLOT;
+
+			if(record->size == 0)
+			{
+				free_slots[num_free_slots++] = slot;
+				continue;
+			}
+		}
+		else
+		{
+			if(record->address == 0)
+				continue;
+
+			slot = num_free_slots ? free_slots[--num_free_slots] : w->num_slots++;
+			add_op(w, record->op == MY_TRACE_CALLOC ? MY_TRACE_CALLOC : MY_TRACE_MALLOC,
+				record->size, slot);
+		}
+
+		find_slot_entry(table, table_size - 1, record->address)->slot = slot;
+	}
+
+	free(table);
+	free(free_slots);
+	free(order);
+	free(records);
+	return 1;
+}
+
+/*The resident set size right now, in KiB.*/
+long current_rss_kib()
+{
+	long pages = 0, resident = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+
+	if(file == NULL)
+		return 0;
+
+	if(fscanf(file, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+
+	fclose(file);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+long peak_rss_kib()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_maxrss;
+}
+
+void touch(void* ptr, unsigned int size)
+{
+	unsigned int offset;
+
+	for(offset = 0; offset < size; offset += TOUCH_STRIDE)
+		((char*)ptr)[offset] = 1;
+}
+
+/*Runs a single-threaded workload, timing each call into samples. Gives the
+most bytes that were ever asked for and not freed yet.*/
+unsigned long long replay(const Workload* w, const Allocator* a, uint32_t* samples, void** slots,
+	unsigned int* sizes)
+{
+	unsigned long long live = 0, peak_live = 0;
+	unsigned int i;
+
+	for(i = 0; i < w->num_ops; i++)
+	{
+		const Op* op = &w->ops[i];
+		void* ptr = NULL;
+		uint64_t start = now_ns();
+
+		switch(op->op)
+		{
+			case MY_TRACE_MALLOC:  ptr = a->malloc(op->size); break;
+			case MY_TRACE_CALLOC:  ptr = a->calloc(1, op->size); break;
+			case MY_TRACE_REALLOC: ptr = a->realloc(slots[op->slot], op->size); break;
+			case MY_TRACE_FREE:    a->free(slots[op->slot]); break;
+		}
+
+		samples[i] = time_since(start);
+
+		if(op->op == MY_TRACE_REALLOC && ptr == NULL && op->size != 0)
+			continue;
+
+		if(op->op == MY_TRACE_REALLOC || op->op == MY_TRACE_FREE)
+		{
+			live -= sizes[op->slot];
+			sizes[op->slot] = 0;
+		}
+
+		slots[op->slot] = ptr;
+
+		if(ptr != NULL)
+		{
+			if(op->op != MY_TRACE_REALLOC)
+				touch(ptr, op->size);
+
+			sizes[op->slot] = op->size;
+			live += op->size;
+
+			if(live > peak_live)
+				peak_live = live;
+		}
+	}
+
+	return peak_live;
+}
+
+/*What prodcons's two threads share.*/
+typedef struct Queue
+{
+	const Workload* w;
+	const Allocator* a;
+	uint32_t* samples;
+	void* items[QUEUE_SIZE];
+	_Atomic unsigned long head; /*How many items the producer has put in.*/
+	_Atomic unsigned long tail; /*How many the consumer has taken out.*/
+} Queue;
+
+void* consume(void* arg)
+{
+	Queue* queue = arg;
+	unsigned long i;
+
+	for(i = 0; i < queue->w->num_ops; i++)
+	{
+		while(atomic_load_explicit(&queue->head, memory_order_acquire) == i)
+			sched_yield();
+
+		void* ptr = queue->items[i % QUEUE_SIZE];
+		uint64_t start = now_ns();
+
+		queue->a->free(ptr);
+		queue->samples[queue->w->num_ops + i] = time_since(start);
+		atomic_store_explicit(&queue->tail, i + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/*Runs prodcons: this thread allocates, another frees. Both threads' calls go
+into samples, the mallocs first.*/
+void replay_threaded(const Workload* w, const Allocator* a, uint32_t* samples)
+{
+	Queue* queue = calloc(1, sizeof(Queue));
+	pthread_t consumer;
+	unsigned long i;
+
+	queue->w = w;
+	queue->a = a;
+	queue->samples = samples;
+	pthread_create(&consumer, NULL, consume, queue);
+
+	for(i = 0; i < w->num_ops; i++)
+	{
+		while(i - atomic_load_explicit(&queue->tail, memory_order_acquire) == QUEUE_SIZE)
+			sched_yield();
+
+		uint64_t start = now_ns();
+		void* ptr = a->malloc(w->ops[i].size);
+
+		samples[i] = time_since(start);
+		touch(ptr, w->ops[i].size);
+		queue->items[i % QUEUE_SIZE] = ptr;
+		atomic_store_explicit(&queue->head, i + 1, memory_order_release);
+	}
+
+	pthread_join(consumer, NULL);
+	free(queue);
+}
+
+int compare_samples(const void* a, const void* b)
+{
+	uint32_t first = *(const uint32_t*)a, second = *(const uint32_t*)b;
+
+	return first < second ? -1 : first > second;
+}
+
+/*Gives the sample at fraction of the way through sorted samples.*/
+uint32_t percentile(const uint32_t* samples, unsigned int n, double fraction)
+{
+	unsigned int i = (unsigned int)(fraction * n);
+
+	return samples[i < n ? i : n - 1];
+}
+
+/*Runs one workload on one allocator, in the forked child, and prints a line
+about it.*/
+void run(const Workload* w, const Allocator* a)
+{
+	unsigned int num_samples = w->threaded ? w->num_ops * 2 : w->num_ops;
+	unsigned int slot_count = w->num_slots ? w->num_slots : 1;
+	uint32_t* samples = malloc(sizeof(uint32_t) * num_samples);
+	void** slots = malloc(sizeof(void*) * slot_count);
+	unsigned int* sizes = malloc(sizeof(unsigned int) * slot_count);
+	unsigned long long peak_live = 0;
+	unsigned int i;
+
+	/*make these resident first, so they don't count toward the allocator's RSS*/
+	memset(samples, 0, sizeof(uint32_t) * num_samples);
+	memset(slots, 0, sizeof(void*) * slot_count);
+	memset(sizes, 0, sizeof(unsigned int) * slot_count);
+
+	long rss_at_start = current_rss_kib();
+
+	if(w->threaded)
+		replay_threaded(w, a, samples);
+	else
+		peak_live = replay(w, a, samples, slots, sizes);
+
+	long peak_rss = peak_rss_kib() - rss_at_start;
+	char fragmentation[16] = "-";
+	char huge[24] = "-";
+
+	if(a->is_mine)
+	{
+		struct my_heap_summary summary;
+		my_heap_summarize(&summary);
+		snprintf(fragmentation, sizeof(fragmentation), "%.1f%%", summary.fragmentation * 100);
+		snprintf(huge, sizeof(huge), "%llu", summary.huge_page_bytes / 1024);
+	}
+
+	for(i = 0; i < w->num_slots; i++)
+		a->free(slots[i]);
+
+	unsigned long long total = 0;
+
+	for(i = 0; i < num_samples; i++)
+		total += samples[i];
+
+	qsort(samples, num_samples, sizeof(uint32_t), compare_samples);
+
+	printf("%-10s %-10s %9u %7.1f %7u %7u %7u %7u %9u %9llu %9ld %6s %9s\n", w->name, a->name,
+		num_samples, (double)total / num_samples, percentile(samples, num_samples, 0.5),
+		percentile(samples, num_samples, 0.9), percentile(samples, num_samples, 0.99),
+		percentile(samples, num_samples, 0.999), samples[num_samples - 1], peak_live / 1024,
+		peak_rss > 0 ? peak_rss : 0, fragmentation, huge);
+
+	free(samples);
+	free(slots);
+	free(sizes);
+}
+
+void run_in_child(const Workload* w, const Allocator* a)
+{
+	int status;
+
+	if(w->threaded && !a->thread_safe)
+	{
+		printf("%-10s %-10s skipped, build with -DMY_MALLOC_THREADS\n", w->name, a->name);
+		return;
+	}
+
+	fflush(stdout);
+	pid_t child = fork();
+
+	if(child == 0)
+	{
+		run(w, a);
+		fflush(stdout);
+		_exit(0);
+	}
+
+	if(child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		printf("%-10s %-10s failed\n", w->name, a->name);
+}
+
+typedef struct WorkloadMaker
+{
+	const char* name;
+	void (*make)(Workload* w, unsigned int num_ops);
+} WorkloadMaker;
+
+WorkloadMaker workload_makers[] =
+{
+	{"uniform", make_uniform},
+	{"powerlaw", make_power_law},
+	{"churn", make_churn},
+	{"prodcons", make_prodcons},
+};
+
+#define NUM_WORKLOADS (sizeof(workload_makers) / sizeof(workload_makers[0]))
+
+/*Makes the workload with this name, or loads it from the trace file at that
+path. Gives 0 if it can't.*/
+int make_workload(Workload* w, const char* name, unsigned int num_ops, uint64_t seed)
+{
+	unsigned int i;
+
+	random_state = seed ? seed : 1;
+
+	for(i = 0; i < NUM_WORKLOADS; i++)
+	{
+		if(strcmp(name, workload_makers[i].name) == 0)
+		{
+			workload_makers[i].make(w, num_ops);
+			return 1;
+		}
+	}
+
+	return load_trace(w, name);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int num_ops = 1000000;
+	uint64_t seed = 1;
+	const char* names[argc + NUM_WORKLOADS];
+	int num_names = 0, i;
+	unsigned int j;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			num_ops = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			seed = strtoull(argv[++i], NULL, 10);
+		else if(argv[i][0] == '-')
+		{
+			printf("Usage:\n\t./bench [-n num_ops] [-s seed] [workload or trace file]...\n"
+				"Where the workloads are uniform, powerlaw, churn and prodcons.\n");
+			return 1;
+		}
+		else
+			names[num_names++] = argv[i];
+	}
+
+	if(num_ops < 2)
+	{
+		printf("You gotta use at least 2 ops.\n");
+		return 1;
+	}
+
+	if(num_names == 0)
+	{
+		for(j = 0; j < NUM_WORKLOADS; j++)
+			names[num_names++] = workload_makers[j].name;
+	}
+
+	timer_overhead = measure_timer_overhead();
+	printf("my_malloc config: %s\n", MY_MALLOC_CONFIG_NAME);
+	printf("my_malloc checks:%s\n", HARDENING_CHECKS[0] != '\0' ? HARDENING_CHECKS : " none");
+	printf("%-10s %-10s %9s %7s %7s %7s %7s %7s %9s %9s %9s %6s %9s\n", "workload", "allocator",
+		"calls", "mean ns", "p50", "p90", "p99", "p99.9", "max", "live KiB", "RSS KiB", "frag",
+		"huge KiB");
+
+	for(i = 0; i < num_names; i++)
+	{
+		Workload w;
+
+		if(!make_workload(&w, names[i], num_ops, seed))
+		{
+			printf("Couldn't read the trace file %s.\n", names[i]);
+			continue;
+		}
+
+		if(w.num_ops == 0)
+		{
+			printf("%s has nothing to replay.\n", names[i]);
+			free(w.ops);
+			continue;
+		}
+
+		for(j = 0; j < NUM_ALLOCATORS; j++)
+			run_in_child(&w, &allocators[j]);
+
+		free(w.ops);
+	}
+
+	return 0;
+}
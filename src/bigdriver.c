@@ -1,4 +1,6 @@
+#include <signal.h>
 #include <stdio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "mymalloc.h"
@@ -24,16 +26,38 @@ NO COMMAS!!*/
 #define MAGENTA(X) CMAGENTA X CRESET
 #define CYAN(X)    CCYAN X CRESET
 
+/*What every block and arena allocation is aligned to, for builds (or
+configurations) that change it.*/
+#ifdef SIZE_MULTIPLE
+#define ALIGNMENT SIZE_MULTIPLE
+#else
+#define ALIGNMENT 8
+#endif
+
+/*Best fit searches a size's own bin even when its first block would do.*/
+#ifdef MY_MALLOC_BEST_FIT
+#define BEST_FIT 1
+#else
+#define BEST_FIT 0
+#endif
+
 #define PTR_ADD_BYTES(ptr, byte_offs) ((void*)(((char*)(ptr)) + (byte_offs)))
 
-void check_heap_size(const char* where, void* heap_at_start)
+void check_heap_size(const char* where)
 {
-	void* heap_at_end = sbrk(0);
-	unsigned int heap_size_diff = (unsigned int)(heap_at_end - heap_at_start);
-
-	if(heap_size_diff)
-		printf(RED("After %s the heap got bigger by %u (0x%X) bytes...\n"),
-			where, heap_size_diff, heap_size_diff);
+	/*The allocator keeps a free top around instead of shrinking the
+	heap on every free, so give it all back before looking.*/
+	my_malloc_trim(0);
+
+	struct my_heap_summary summary;
+	my_heap_summarize(&summary);
+
+	if(summary.used_blocks)
+		printf(RED("After %s, %u blocks (%llu bytes) are still allocated...\n"),
+			where, summary.used_blocks, summary.used_bytes);
+	else if(summary.heap_bytes)
+		printf(RED("After %s the heap is still %llu (0x%llX) bytes big...\n"),
+			where, summary.heap_bytes, summary.heap_bytes);
 	else
 		printf(GREEN("Yay, after %s, everything was freed!\n"), where);
 }
@@ -58,7 +82,6 @@ then frees them in reverse order. Even the simplest allocator should
 work for this, and the heap should be back where it started afterwards.*/
 void test_simple()
 {
-	void* heap_at_start = sbrk(0);
 	int* a = make_array(10);
 	int* b = make_array(10);
 
@@ -71,14 +94,13 @@ void test_simple()
 	my_free(b);
 	my_free(a);
 
-	check_heap_size("test_simple", heap_at_start);
+	check_heap_size("test_simple");
 }
 
 /*A more complex test that makes sure you can deallocate in any order and
 that those deallocated blocks can be reused.*/
 void test_reuse()
 {
-	void* heap_at_start = sbrk(0);
 	int* a = make_array(20);
 
 	int* b = make_array(20);
@@ -106,7 +128,7 @@ void test_reuse()
 
 	But if you DID implement splitting, you will have:
 	- A used 40-byte block at the beginning
-	- A free *24-byte* block in the middle
+	- A free *32-byte* block in the middle
 	- A used 80-byte block as the heap_tail*/
 
 	my_free(c);
@@ -127,13 +149,12 @@ void test_reuse()
 	But if you DID implement coalescing, you will have
 	nothing left on the heap here! */
 
-	check_heap_size("test_reuse", heap_at_start);
+	check_heap_size("test_reuse");
 }
 
 /*Makes sure that your coalescing works.*/
 void test_coalescing()
 {
-	void* heap_at_start = sbrk(0);
 	int* a = make_array(10);
 	int* b = make_array(10);
 	int* c = make_array(10);
@@ -149,12 +170,12 @@ void test_coalescing()
 	After each of these frees, you should have ONE
 	free block of the given size:*/
 	my_free(a); /* 40B */
-	my_free(b); /* 96B */
-	my_free(c); /* 152B */
-	my_free(d); /* 208B */
+	my_free(b); /* 88B */
+	my_free(c); /* 136B */
+	my_free(d); /* 184B */
 
 	/*This should reuse a's block.*/
-	int* f = make_array(52);
+	int* f = make_array(46);
 
 	if(a != f)
 		printf(RED("You didn't reuse the coalesced block!\n"));
@@ -164,7 +185,7 @@ void test_coalescing()
 	my_free(f);
 	my_free(e);
 
-	check_heap_size("part 1 of test_coalescing", heap_at_start);
+	check_heap_size("part 1 of test_coalescing");
 
 	/* Let's re-allocate... */
 	a = make_array(10);
@@ -180,11 +201,11 @@ void test_coalescing()
 	After each you should have:*/
 	my_free(b); /* one free 40B */
 	my_free(d); /* two free 40B */
-	my_free(a); /* one free 96B, one free 40B */
-	my_free(c); /* one free 208B */
+	my_free(a); /* one free 88B, one free 40B */
+	my_free(c); /* one free 184B */
 	my_free(e); /* nothing left! */
 
-	check_heap_size("part 2 of test_coalescing", heap_at_start);
+	check_heap_size("part 2 of test_coalescing");
 
 	/*Finally, let's make sure coalescing at the beginning
 	and end of the heap work properly.*/
@@ -197,19 +218,17 @@ void test_coalescing()
 
 	/*After each you should have:*/
 	my_free(b); /* one free 40B, four used 40B */
-	my_free(a); /* one free 96B, three used 40B */
-	my_free(d); /* one free 96B, one free 40B, two used 40B */
-	my_free(e); /* one free 96B, one used 40B */
+	my_free(a); /* one free 88B, three used 40B */
+	my_free(d); /* one free 88B, one free 40B, two used 40B */
+	my_free(e); /* one free 88B, one used 40B */
 	my_free(c); /* nothing left! */
 
-	check_heap_size("part 3 of test_coalescing", heap_at_start);
+	check_heap_size("part 3 of test_coalescing");
 }
 
 /*Makes sure that your block splitting works.*/
 void test_splitting()
 {
-	void* heap_at_start = sbrk(0);
-
 	int* medium = make_array(64); /*make a 256-byte block.*/
 	int* holder = make_array(4);  /*holds the break back.*/
 	my_free(medium);
@@ -250,15 +269,15 @@ void test_splitting()
 	my_free(tiny4);
 	my_free(too_big);
 	my_free(holder);
-	check_heap_size("test_splitting part 1", heap_at_start);
+	check_heap_size("test_splitting part 1");
 
 	int* huge = make_array(1024);
 	holder = make_array(4);
-	/*This huge array should go in the overflow bin.*/
+	/*This huge array should go in a geometric bin.*/
 	my_free(huge);
 
-	/*You should have a 4096B block in the overflow bin. Let's
-	split it. The remainders will stay in the overflow bin and
+	/*You should have a 4096B block in a geometric bin. Let's
+	split it. The remainders will stay in the geometric bins and
 	will be the following sizes:*/
 	tiny1 = make_array(4); /* 4064B */
 	tiny2 = make_array(4); /* 4032B */
@@ -275,8 +294,8 @@ void test_splitting()
 		printf(RED("You didn't split the 4000B block!\n"));
 
 	/*Last, let's see if you can reuse that *whole* 3968B block,
-	since we are using first-fit in the overflow bin, and can
-	use blocks even if they're not splittable*/
+	since the geometric bins fall back to searching a size's own
+	bin, and can use blocks even if they're not splittable*/
 
 	int* right_size = make_array(3968/4);
 
@@ -291,12 +310,574 @@ void test_splitting()
 	my_free(tiny4);
 	my_free(holder);
 	my_free(right_size);
-	check_heap_size("test_splitting part 2", heap_at_start);
+	check_heap_size("test_splitting part 2");
+}
+
+/*Returns 1 if arr still holds what fill_array put in its first length ints.*/
+int check_array(int* arr, int length)
+{
+	int i;
+
+	for(i = 0; i < length; i++)
+		if(arr[i] != i + 1)
+			return 0;
+
+	return 1;
+}
+
+/*Makes sure my_realloc resizes in place whenever the neighbors allow it.*/
+void test_realloc()
+{
+	int* a = make_array(64);
+	int* b = make_array(64);
+	int* holder = make_array(4);
+
+	/*Shrinking should always stay put, and the freed tail should
+	coalesce with whatever comes after it.*/
+	int* shrunk = my_realloc(a, sizeof(int) * 16);
+
+	if(shrunk != a || !check_array(shrunk, 16))
+		printf(RED("You didn't shrink the block in place!\n"));
+
+	/*Now free b, so a has a big free neighbor to grow into.*/
+	my_free(b);
+	int* grown = my_realloc(shrunk, sizeof(int) * 128);
+
+	if(grown != a || !check_array(grown, 16))
+		printf(RED("You didn't grow into the free neighbor!\n"));
+
+	/*The holder is at the tail, so it can grow by extending the heap.*/
+	int* grown_tail = my_realloc(holder, sizeof(int) * 1000);
+
+	if(grown_tail != holder || !check_array(grown_tail, 4))
+		printf(RED("You didn't grow the tail block in place!\n"));
+
+	/*a is now stuck between used blocks, so it has to move.*/
+	int* moved = my_realloc(grown, sizeof(int) * 4096);
+
+	if(!check_array(moved, 16))
+		printf(RED("You lost the data when moving the block!\n"));
+
+	my_free(moved);
+	my_free(grown_tail);
+	check_heap_size("test_realloc");
+}
+
+/*Makes sure my_memalign gives aligned blocks and gives the padding back.*/
+void test_memalign()
+{
+	unsigned int alignments[] = {32, 64, 4096};
+	void* blocks[3];
+	int i;
+
+	for(i = 0; i < 3; i++) {
+		blocks[i] = my_memalign(alignments[i], 100);
+		fill_array(blocks[i], 25);
+
+		if(((unsigned long)blocks[i] & (alignments[i] - 1)) != 0)
+			printf(RED("You didn't align the block to %u bytes!\n"), alignments[i]);
+	}
+
+	/*The padding in front of the 4096-aligned block is big enough
+	for this, so it shouldn't need to grow the heap past it.*/
+	int* in_padding = make_array(10);
+
+	if((void*)in_padding > blocks[2])
+		printf(RED("You didn't reuse the alignment padding!\n"));
+
+	for(i = 0; i < 3; i++)
+		if(!check_array(blocks[i], 25))
+			printf(RED("You lost the data in the aligned block!\n"));
+
+	my_free(in_padding);
+
+	for(i = 0; i < 3; i++)
+		my_free(blocks[i]);
+
+	check_heap_size("test_memalign");
+}
+
+/*Makes sure my_free_batch frees everything, in any order.*/
+void test_free_batch()
+{
+	void* blocks[6];
+	int i;
+
+	for(i = 0; i < 5; i++)
+		blocks[i] = make_array(10 * (i + 1));
+
+	/*Out of order, with a NULL, and with a hole in the middle
+	that gets freed on its own first.*/
+	my_free(blocks[2]);
+	blocks[2] = blocks[4];
+	blocks[4] = NULL;
+	blocks[5] = blocks[0];
+	blocks[0] = make_array(100);
+
+	my_free_batch(blocks, 6);
+	check_heap_size("test_free_batch");
+}
+
+/*Makes sure my_malloc_batch gives usable blocks, packed together
+when they come off the top of the heap.*/
+void test_malloc_batch()
+{
+	void* blocks[100];
+	int i;
+
+	if(my_malloc_batch(sizeof(int) * 10, 100, blocks) != 100)
+		printf(RED("You didn't allocate the whole batch!\n"));
+
+	for(i = 0; i < 100; i++)
+		fill_array(blocks[i], 10);
+
+	/*Nothing was free, so they should all be back to back, 48
+	bytes apart.*/
+	for(i = 1; i < 100; i++)
+		if(blocks[i] != PTR_ADD_BYTES(blocks[i - 1], 48))
+			break;
+
+	if(i < 100)
+		printf(RED("You didn't carve the batch contiguously!\n"));
+
+	for(i = 0; i < 100; i++)
+		if(!check_array(blocks[i], 10))
+			break;
+
+	if(i < 100)
+		printf(RED("The batch blocks overlap!\n"));
+
+	my_free_batch(blocks, 100);
+	check_heap_size("test_malloc_batch");
+}
+
+/*Makes sure arena allocations don't overlap, and that resetting
+and destroying the arena gives everything back.*/
+void test_arena()
+{
+	MyArena* arena = my_arena_create(4096);
+	int* arrays[200];
+	int i;
+
+	/*Enough to need a few chunks, plus one too big for any chunk.*/
+	for(i = 0; i < 200; i++) {
+		arrays[i] = my_arena_alloc(arena, sizeof(int) * (i % 20 + 1));
+		fill_array(arrays[i], i % 20 + 1);
+	}
+
+	int* big = my_arena_alloc(arena, sizeof(int) * 4000);
+	fill_array(big, 4000);
+
+	for(i = 0; i < 200; i++)
+		if(!check_array(arrays[i], i % 20 + 1))
+			break;
+
+	if(i < 200 || !check_array(big, 4000))
+		printf(RED("The arena allocations overlap!\n"));
+
+	/*After a reset, the arena should start over at the
+	beginning of the chunk it kept.*/
+	my_arena_reset(arena);
+	int* first = my_arena_alloc(arena, sizeof(int));
+	int* second = my_arena_alloc(arena, sizeof(int));
+
+	if(second != PTR_ADD_BYTES(first, ALIGNMENT))
+		printf(RED("You didn't bump-allocate from the kept chunk!\n"));
+
+	/*A chunk this big can't be handed to my_malloc in one piece.*/
+	if(my_arena_alloc(arena, 0xFFFFFFF8) != NULL)
+		printf(RED("You gave out an arena chunk bigger than my_malloc can make!\n"));
+
+	my_arena_destroy(arena);
+	check_heap_size("test_arena");
+}
+
+/*Makes sure the stats count an allocation and its free.*/
+void test_stats()
+{
+	struct my_stats before, during, after;
+
+	/*Nothing to check if they were compiled out.*/
+	if(!my_malloc_stats(&before))
+		return;
+
+	int* a = make_array(100);
+	my_malloc_stats(&during);
+	my_free(a);
+	my_malloc_stats(&after);
+
+	if(during.mallocs != before.mallocs + 1 || during.bytes_in_use < before.bytes_in_use + 400)
+		printf(RED("You didn't count the allocation!\n"));
+	else if(after.frees != before.frees + 1 || after.bytes_in_use != before.bytes_in_use)
+		printf(RED("You didn't count the free!\n"));
+	else
+		printf(GREEN("Yay, the stats add up!\n"));
+}
+
+/*my_heap_walk visitor for test_heap_walk. Clears *arg once it sees the free
+block that *arg points to.*/
+void find_free_block(const struct my_block_info* info, void* arg)
+{
+	void** looking_for = arg;
+
+	if(!info->in_use && info->address == *looking_for)
+		*looking_for = NULL;
+}
+
+/*Makes sure walking the heap finds a block freed in between two used ones,
+and that the summary of the heap agrees.*/
+void test_heap_walk()
+{
+	int* a = make_array(150);
+	int* b = make_array(150);
+	int* c = make_array(150);
+
+	my_free(b);
+
+	void* looking_for = b;
+	my_heap_walk(find_free_block, &looking_for);
+
+	struct my_heap_summary summary;
+	my_heap_summarize(&summary);
+
+	if(looking_for != NULL)
+		printf(RED("Walking the heap didn't find the freed block!\n"));
+	else if(summary.used_blocks < 2 || summary.free_blocks < 1 || summary.largest_free < 600)
+		printf(RED("The heap summary doesn't add up!\n"));
+	else
+		printf(GREEN("Yay, the heap walk found the freed block!\n"));
+
+	my_free(a);
+	my_free(c);
+
+	check_heap_size("test_heap_walk");
+}
+
+/*Makes sure my_malloc_at_least tells the truth about how much room a block
+has: all of it can be written, and reallocating into it doesn't move it.*/
+void test_usable_size()
+{
+	unsigned int actual;
+	char* a = my_malloc_at_least(10, &actual);
+	unsigned int i;
+
+	for(i = 0; i < actual; i++)
+		a[i] = i;
+
+	if(actual < 10 || actual != my_malloc_usable_size(a))
+		printf(RED("my_malloc_at_least gave the wrong size!\n"));
+	else if(my_realloc(a, actual) != a)
+		printf(RED("You moved the block even though it had room!\n"));
+	else
+		printf(GREEN("Yay, the block had %u usable bytes!\n"), actual);
+
+	my_free(a);
+
+	check_heap_size("test_usable_size");
+}
+
+/*Makes sure purging gives back the pages inside free blocks in the middle of
+the heap, but not before they've stayed free through one purge.*/
+void test_purge()
+{
+	struct my_stats freed, aged, purged;
+
+	if(!my_malloc_stats(&freed))
+		return;
+
+	/*big enough to have whole (huge) pages inside, but still on the heap*/
+	my_mallopt(MY_M_MMAP_THRESHOLD, 16 * 1024 * 1024);
+	my_mallopt(MY_M_PURGE_THRESHOLD, 0);
+
+	char* a = my_malloc(1024);
+	char* b = my_malloc(5 * 1024 * 1024);
+	char* c = my_malloc(1024);
+	char* d = my_malloc(1024 * 1024);
+	char* e = my_malloc(1024);
+
+	my_free(b);
+	my_free(d);
+
+	my_malloc_stats(&freed);
+	my_malloc_purge();
+	my_malloc_stats(&aged);
+	my_malloc_purge();
+	my_malloc_stats(&purged);
+
+	if(freed.bytes_dirty == 0)
+		printf(RED("You didn't count the free blocks' pages as dirty!\n"));
+	else if(aged.purged_bytes != freed.purged_bytes)
+		printf(RED("You purged blocks that were only just freed!\n"));
+	else if(purged.bytes_dirty != 0 ||
+		purged.purged_bytes - aged.purged_bytes != freed.bytes_dirty)
+		printf(RED("You didn't purge the blocks that stayed free!\n"));
+	else
+		printf(GREEN("Yay, %llu bytes of free blocks were purged!\n"),
+			purged.purged_bytes - aged.purged_bytes);
+
+	my_free(a);
+	my_free(c);
+	my_free(e);
+
+	my_mallopt(MY_M_MMAP_THRESHOLD, 128 * 1024);
+	my_mallopt(MY_M_PURGE_THRESHOLD, 4 * 1024 * 1024);
+
+	check_heap_size("test_purge");
+}
+
+/*Makes sure a big heap is backed by huge pages, when it's built with
+-DMY_MALLOC_HUGEPAGES. The kernel doesn't always have them to give, so not
+getting any is only a warning.*/
+void test_huge_pages()
+{
+	char* blocks[128];
+	int i, j;
+
+	/*small enough to stay on the heap instead of getting their own mmap*/
+	for(i = 0; i < 128; i++) {
+		blocks[i] = my_malloc(64 * 1024);
+
+		for(j = 0; j < 64 * 1024; j += 4096)
+			blocks[i][j] = i;
+	}
+
+	struct my_heap_summary summary;
+	my_heap_summarize(&summary);
+
+	if(summary.huge_page_bytes > summary.heap_bytes)
+		printf(RED("More of the heap is in huge pages than there is heap!\n"));
+	else if(summary.huge_page_bytes == 0)
+		printf(YELLOW("None of the heap is in huge pages.\n"));
+	else
+		printf(GREEN("Yay, %llu of the heap's %llu bytes are in huge pages!\n"),
+			summary.huge_page_bytes, summary.heap_bytes);
+
+	for(i = 0; i < 128; i++)
+		my_free(blocks[i]);
+
+	check_heap_size("test_huge_pages");
+}
+
+/*Makes sure a heap of its own keeps its blocks apart from the default heap,
+even when they grow, and that destroying it frees what's still allocated.*/
+/*Gives 1 if one of the bins starts at exactly size bytes.*/
+int has_size_class(unsigned int size)
+{
+	struct my_heap_summary summary;
+	unsigned int bin;
+
+	my_heap_summarize(&summary);
+
+	for(bin = 0; bin < summary.num_bins; bin++) {
+		if(summary.bin_min_sizes[bin] == size)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*Makes sure sampled and given sizes get size classes of their own, which are
+reused with no search.*/
+void test_size_classes()
+{
+	unsigned int sizes[] = {1500};
+	struct my_stats before, after;
+	int i;
+
+	my_malloc_sample_sizes(1);
+
+	for(i = 0; i < 256; i++)
+		my_free(my_malloc(3000));
+
+	my_malloc_sample_sizes(0);
+
+	if(my_malloc_tune_size_classes() == 0 || !has_size_class(3000)) {
+		printf(RED("You didn't give the sampled size a class of its own!\n"));
+		return;
+	}
+
+	my_malloc_set_size_classes(sizes, 1);
+
+	char* a = my_malloc(1500);
+	char* b = my_malloc(1500);
+	unsigned int rounded = my_malloc_usable_size(a);
+	my_free(a);
+
+	int counted = my_malloc_stats(&before);
+	char* c = my_malloc(1500);
+	my_malloc_stats(&after);
+
+	if(!has_size_class(rounded) || has_size_class(3000))
+		printf(RED("You didn't replace the size classes!\n"));
+	else if(c != a)
+		printf(RED("You didn't reuse the block in the size's own class!\n"));
+	else if(counted && !BEST_FIT && after.overflow_searches != before.overflow_searches)
+		printf(RED("You searched for a block in the size's own class!\n"));
+	else
+		printf(GREEN("Yay, sizes got classes of their own!\n"));
+
+	my_free(b);
+	my_free(c);
+	my_malloc_set_size_classes(NULL, 0);
+
+	if(has_size_class(rounded))
+		printf(RED("You didn't put back the usual size classes!\n"));
+
+	check_heap_size("test_size_classes");
+}
+
+/*Gives 1 if the size bytes at big (which may be NULL) don't take in small.*/
+int apart(char* big, unsigned int size, char* small)
+{
+	return big == NULL || small < big || small >= big + size;
+}
+
+/*Makes sure requests so big they'd wrap around when rounded up are turned down,
+or at least given room of their own, instead of overlapping the next block.*/
+void test_huge_requests()
+{
+	unsigned int sizes[] = {0xFFFFFFFF, 0xFFFFFFF0, 0xFFFFFFF0 - 32, 0xFFFFF000};
+	int overlap = 0;
+	unsigned int i;
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char* small = my_malloc(16);
+		char* big = my_malloc(sizes[i]);
+		char* next = my_malloc(16);
+		char* aligned = my_memalign(64, sizes[i]);
+		char* grown = my_realloc(small, sizes[i]);
+
+		overlap |= !apart(big, sizes[i], small) || !apart(big, sizes[i], next) ||
+			!apart(aligned, sizes[i], small) || !apart(aligned, sizes[i], next);
+
+		my_free(big);
+		my_free(aligned);
+		my_free(grown != NULL ? grown : small);
+		my_free(next);
+	}
+
+	if(overlap)
+		printf(RED("A huge request overlapped another block!\n"));
+	else
+		printf(GREEN("Yay, huge requests didn't overlap anything!\n"));
+
+	check_heap_size("test_huge_requests");
+}
+
+/*Makes sure a heap either turns down an allocation too big for it or gives
+one that can be written from one end to the other.*/
+void test_huge_heap_malloc()
+{
+	MyHeap* handle = my_heap_create();
+	unsigned int size = 0x90000000;
+	char* big = my_heap_malloc(handle, size);
+
+	if(big != NULL) {
+		big[0] = 1;
+		big[size - 1] = 2;
+	}
+
+	if(big != NULL && (big[0] != 1 || big[size - 1] != 2))
+		printf(RED("The huge heap allocation can't hold what's written to it!\n"));
+	else
+		printf(GREEN("Yay, the huge heap allocation was %s!\n"),
+			big != NULL ? "usable" : "turned down");
+
+	my_heap_destroy(handle);
+
+	/*Now free an even bigger block in the middle of a heap, so the next huge
+	allocation gets split from a bin instead of carved from the top.*/
+	handle = my_heap_create();
+	char* bigger = my_heap_malloc(handle, 0xA0000000);
+	my_heap_malloc(handle, 64);
+	my_heap_free(handle, bigger);
+	big = my_heap_malloc(handle, size);
+
+	if(big != NULL) {
+		big[0] = 1;
+		big[size - 1] = 2;
+	}
+
+	if(big != NULL && (big[0] != 1 || big[size - 1] != 2))
+		printf(RED("The huge block split from a bin can't hold what's written to it!\n"));
+	else if(big != NULL && bigger != NULL && big != bigger)
+		printf(RED("You didn't reuse the freed huge block!\n"));
+
+	my_heap_destroy(handle);
+}
+
+void test_heap_handles()
+{
+	struct my_stats before, after;
+	int have_stats = my_malloc_stats(&before);
+	MyHeap* heap = my_heap_create();
+
+	if(heap == NULL) {
+		printf(RED("You couldn't make a heap!\n"));
+		return;
+	}
+
+	int* a = my_heap_malloc(heap, sizeof(int) * 100);
+	char* big = my_heap_malloc(heap, 1024 * 1024);
+	int* b = make_array(100);
+
+	fill_array(a, 100);
+	big[0] = 1;
+	big = my_realloc(big, 2 * 1024 * 1024);
+
+	if(big == NULL || big[0] != 1 || a[99] != 100)
+		printf(RED("The heap's blocks didn't keep what was in them!\n"));
+
+	my_heap_free(heap, big);
+
+	/*a is still allocated*/
+	my_heap_destroy(heap);
+
+	if(b[99] != 100)
+		printf(RED("Destroying the heap broke a block from the default heap!\n"));
+
+	my_free(b);
+	my_malloc_stats(&after);
+
+	if(have_stats && (after.bytes_in_use != before.bytes_in_use ||
+		after.mallocs - after.frees != before.mallocs - before.frees))
+		printf(RED("Destroying the heap didn't count its blocks as freed!\n"));
+	else
+		printf(GREEN("Yay, the heap was destroyed with its blocks!\n"));
+
+	check_heap_size("test_heap_handles");
+}
+
+/*Makes sure freeing a block twice is caught, in builds that check for it. The
+allocator aborts when it is, so it's done in a child process.*/
+void test_double_free()
+{
+#if defined(MY_MALLOC_HARDENED) || defined(MY_MALLOC_DOUBLE_FREE_CHECKS)
+	int status;
+	pid_t child = fork();
+
+	if(child == 0) {
+		int* a = make_array(100);
+		my_free(a);
+		my_free(a);
+		_exit(0);
+	}
+
+	if(child < 0 || waitpid(child, &status, 0) < 0)
+		printf(RED("Couldn't run the double free!\n"));
+	else if(!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT)
+		printf(RED("You didn't catch the double free!\n"));
+	else
+		printf(GREEN("Yay, the double free was caught!\n"));
+#endif
 }
 
 int main()
 {
-	void* heap_at_start = sbrk(0);
+	/*Otherwise stdout's buffer gets malloc'd by the system's malloc the first
+	time something is printed, which can move the break past our heap, and then
+	the heap can never shrink back.*/
+	setvbuf(stdout, NULL, _IONBF, 0);
 
 	/*Uncomment a test and recompile before running it.
 	When complete, you should be able to uncomment all the tests
@@ -311,8 +892,23 @@ int main()
 	to make sure your binning works.*/
 
 	test_splitting();
+	test_realloc();
+	test_memalign();
+	test_free_batch();
+	test_malloc_batch();
+	test_arena();
+	test_stats();
+	test_heap_walk();
+	test_usable_size();
+	test_purge();
+	test_size_classes();
+	test_heap_handles();
+	test_huge_heap_malloc();
+	test_huge_requests();
+	test_huge_pages();
+	test_double_free();
 
 	/*Just to make sure!*/
-	check_heap_size("main", heap_at_start);
+	check_heap_size("main");
 	return 0;
 }
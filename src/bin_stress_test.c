@@ -29,14 +29,21 @@ NO COMMAS!!*/
 
 #define PTR_ADD_BYTES(ptr, byte_offs) ((void*)(((char*)(ptr)) + (byte_offs)))
 
-void check_heap_size(const char* where, void* heap_at_start)
+void check_heap_size(const char* where)
 {
-	void* heap_at_end = sbrk(0);
-	unsigned int heap_size_diff = (unsigned int)(heap_at_end - heap_at_start);
-
-	if(heap_size_diff)
-		printf(RED("After %s the heap got bigger by %u (0x%X) bytes...\n"),
-			where, heap_size_diff, heap_size_diff);
+	/*The allocator keeps a free top around instead of shrinking the
+	heap on every free, so give it all back before looking.*/
+	my_malloc_trim(0);
+
+	struct my_heap_summary summary;
+	my_heap_summarize(&summary);
+
+	if(summary.used_blocks)
+		printf(RED("After %s, %u blocks (%llu bytes) are still allocated...\n"),
+			where, summary.used_blocks, summary.used_bytes);
+	else if(summary.heap_bytes)
+		printf(RED("After %s the heap is still %llu (0x%llX) bytes big...\n"),
+			where, summary.heap_bytes, summary.heap_bytes);
 	else
 		printf(GREEN("Yay, after %s, everything was freed!\n"), where);
 }
@@ -66,8 +73,6 @@ uint64_t get_usec()
 
 void test_basic_binning()
 {
-	void* heap_at_start = sbrk(0);
-
 	void* a = make_array(4);
 	void* b = make_array(4);
 	void* c = make_array(4);
@@ -105,13 +110,14 @@ void test_basic_binning()
 	my_free(cc);
 	my_free(aa);
 
-	check_heap_size("test_basic_binning", heap_at_start);
+	check_heap_size("test_basic_binning");
 }
 
 void test_speed(long num_iter)
 {
-	void* blocks[num_iter * 2]; /*biiiig stack array...*/
-	void* heap_at_start = sbrk(0);
+	/*This comes from the system's malloc, so it's not part of the heap being
+	tested, and it's too big for the stack when num_iter is big.*/
+	void** blocks = malloc(sizeof(void*) * num_iter * 2);
 
 	/* Step 1: allocate a buncha blocks, and free every other one, so we have a ton of
 	stuff in one bin. (Freeing every other one to avoid coalescing) */
@@ -154,8 +160,10 @@ void test_speed(long num_iter)
 
 	uint64_t step3_time = get_usec() - start_time;
 
+	free(blocks);
+
 	/* Now to check everything. */
-	check_heap_size("test_speed", heap_at_start);
+	check_heap_size("test_speed");
 
 	unsigned int heap_size_diff = (unsigned int)(heap_after_step2 - heap_before_step2);
 
@@ -187,7 +195,10 @@ Run this program like:
 
 	./bin_stress 1000
 
-The larger the number, the more blocks it will allocate in the speed test.
+The larger the number, the more blocks it will allocate in the speed test. To try it with
+deferred coalescing, give the biggest block size to defer as a second number:
+
+	./bin_stress 1000 512
 
 IF YOU DIDN'T IMPLEMENT ANY FREE LISTS AT ALL, and your "find a free block" algorithm is "look
 through the entire heap", then you will only be able to use about 10000. Bigger numbers will take
@@ -206,7 +217,8 @@ int main(int argc, char** argv)
 
 	if(argc == 1)
 	{
-		printf("Usage:\n\t./bin_stress <num_iter>\nWhere num_iter is an int >= 1000.\n");
+		printf("Usage:\n\t./bin_stress <num_iter> [mxfast]\nWhere num_iter is an int >= 1000,"
+			" and mxfast turns on deferred coalescing for blocks up to that size.\n");
 		return 1;
 	}
 	else
@@ -220,11 +232,20 @@ int main(int argc, char** argv)
 		}
 	}
 
-	void* heap_at_start = sbrk(0);
+	if(argc > 2 && !my_mallopt(MY_M_MXFAST, strtol(argv[2], NULL, 10)))
+	{
+		printf("mxfast has to be between 0 and 512.\n");
+		return 1;
+	}
+
+	/*Otherwise stdout's buffer gets malloc'd by the system's malloc the first
+	time something is printed, which can move the break past our heap, and then
+	the heap can never shrink back.*/
+	setvbuf(stdout, NULL, _IONBF, 0);
 
 	test_basic_binning();
 	test_speed(num_iter);
 
-	check_heap_size("main", heap_at_start);
+	check_heap_size("main");
 	return 0;
 }
@@ -0,0 +1,49 @@
+/*
+The configuration for small single-threaded systems, for -DMY_MALLOC_CONFIG='"config_embedded.h"'.
+There are no locks, thread caches or statistics, blocks are best fit to keep fragmentation down,
+and the heap grows and shrinks a few pages at a time.
+*/
+
+#ifndef _CONFIG_EMBEDDED_H_
+#define _CONFIG_EMBEDDED_H_
+
+#ifdef MY_MALLOC_THREADS
+#error "the embedded configuration is single-threaded"
+#endif
+
+#define MY_MALLOC_CONFIG_NAME "embedded"
+
+#ifndef MY_MALLOC_NO_STATS
+#define MY_MALLOC_NO_STATS
+#endif
+
+#ifndef MY_MALLOC_BEST_FIT
+#define MY_MALLOC_BEST_FIT
+#endif
+
+// Half as many small bins, so every heap's bins take up less memory.
+#ifndef BIGGEST_BINNED_LOG
+#define BIGGEST_BINNED_LOG 8
+#endif
+
+#ifndef DEFAULT_GROW_CHUNK
+#define DEFAULT_GROW_CHUNK (16 * 1024)
+#endif
+
+#ifndef DEFAULT_TRIM_THRESHOLD
+#define DEFAULT_TRIM_THRESHOLD (32 * 1024)
+#endif
+
+#ifndef DEFAULT_MMAP_THRESHOLD
+#define DEFAULT_MMAP_THRESHOLD (64 * 1024)
+#endif
+
+#ifndef DEFAULT_PURGE_THRESHOLD
+#define DEFAULT_PURGE_THRESHOLD (256 * 1024)
+#endif
+
+#ifndef MAPPED_SEGMENT_SIZE
+#define MAPPED_SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
+
+#endif
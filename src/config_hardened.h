@@ -0,0 +1,19 @@
+/*
+The configuration for hardened multi-threaded builds, for
+-DMY_MALLOC_CONFIG='"config_hardened.h"'. It's the server configuration with every hardening check
+on, so a corrupted heap or a double free aborts instead of being used.
+*/
+
+#ifndef _CONFIG_HARDENED_H_
+#define _CONFIG_HARDENED_H_
+
+#ifndef MY_MALLOC_HARDENED
+#define MY_MALLOC_HARDENED
+#endif
+
+#include "config_server.h"
+
+#undef MY_MALLOC_CONFIG_NAME
+#define MY_MALLOC_CONFIG_NAME "hardened"
+
+#endif
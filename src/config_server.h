@@ -0,0 +1,33 @@
+/*
+The configuration for multi-threaded servers, for -DMY_MALLOC_CONFIG='"config_server.h"'. Every
+thread gets a cache, blocks are 16-byte aligned like glibc's, and the heap grows in bigger steps
+and keeps more free memory before trimming, so syscalls are rare. Add -DMY_MALLOC_NUMA on machines
+with more than one NUMA node.
+*/
+
+#ifndef _CONFIG_SERVER_H_
+#define _CONFIG_SERVER_H_
+
+#define MY_MALLOC_CONFIG_NAME "server"
+
+#ifndef MY_MALLOC_THREADS
+#define MY_MALLOC_THREADS
+#endif
+
+#ifndef SIZE_MULTIPLE
+#define SIZE_MULTIPLE 16
+#endif
+
+#ifndef DEFAULT_GROW_CHUNK
+#define DEFAULT_GROW_CHUNK (1024 * 1024)
+#endif
+
+#ifndef DEFAULT_TRIM_THRESHOLD
+#define DEFAULT_TRIM_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+#ifndef DEFAULT_MMAP_THRESHOLD
+#define DEFAULT_MMAP_THRESHOLD (1024 * 1024)
+#endif
+
+#endif
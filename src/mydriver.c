@@ -4,7 +4,6 @@ A small test for mymalloc.c
 */
 
 #include <stdio.h>
-#include <unistd.h>
 #include "mymalloc.h"
 
 void test1()
@@ -34,19 +33,20 @@ void test1()
 
 int main()
 {
-	void* heap_at_start = sbrk(0);
-
 	test1();
 
-	// The code below and at the beginning of the function checks
-	// that you contracted the heap properly (assuming you've freed
-	// everything that you allocated).
+	// The code below checks that you contracted the heap properly
+	// (assuming you've freed everything that you allocated). The
+	// allocator keeps a free top around, so trim it first.
+
+	my_malloc_trim(0);
 
-	void* heap_at_end = sbrk(0);
-	unsigned int heap_size_diff = (unsigned int)(heap_at_end - heap_at_start);
+	struct my_heap_summary summary;
+	my_heap_summarize(&summary);
 
-	if(heap_size_diff)
-		printf("Hmm, the heap got bigger by %u (0x%X) bytes...\n", heap_size_diff, heap_size_diff);
+	if(summary.heap_bytes)
+		printf("Hmm, the heap is still %llu (0x%llX) bytes big...\n", summary.heap_bytes,
+			summary.heap_bytes);
 
 	return 0;
 }
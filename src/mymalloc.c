@@ -3,47 +3,443 @@ Author: Benjamin Runco
 An implementation of malloc & free.
 */
 
+// for mremap
+#define _GNU_SOURCE
+
+// the build's configuration (see mymalloc.h) goes first, since everything below depends on it
+#ifdef MY_MALLOC_CONFIG
+#include MY_MALLOC_CONFIG
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#if defined(MY_MALLOC_THREADS) || defined(MY_MALLOC_TRACE)
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#ifdef MY_MALLOC_TRACE
+#include <time.h>
+#endif
+
+#ifdef MY_MALLOC_NUMA
+#include <sys/syscall.h>
+#endif
+
 #include "mymalloc.h"
 
+#ifdef MY_MALLOC_TRACE
+#include "mytrace.h"
+#endif
+
 // The smallest allocation possible is this many bytes.
 // Any allocations <= this size will b put in bin 0.
-#define MINIMUM_ALLOCATION  16
+// A free block's data has to hold its two free list pointers and its footer.
+#ifndef MINIMUM_ALLOCATION
+#define MINIMUM_ALLOCATION  24
+#endif
 
-// Every bin holds blocks whose sizes are a multiple of this number.
+// Every bin holds blocks whose sizes are a multiple of this number, and every block's data is
+// aligned to it. It has to be a power of two, at least 8.
+#ifndef SIZE_MULTIPLE
 #define SIZE_MULTIPLE       8
+#endif
+
+// The biggest small bin holds blocks of this size. Anything bigger will go in a geometric bin.
+// It has to be a power of two, 1 << BIGGEST_BINNED_LOG.
+#ifndef BIGGEST_BINNED_LOG
+#define BIGGEST_BINNED_LOG  9
+#endif
+#define BIGGEST_BINNED_SIZE (1 << BIGGEST_BINNED_LOG)
+
+// How many small bins there are, each holding blocks of exactly one size. There's an "underflow"
+// bin (bin 0), which is where the '1' comes from in this formula.
+#define NUM_SMALL_BINS      (1 + ((BIGGEST_BINNED_SIZE - MINIMUM_ALLOCATION) / SIZE_MULTIPLE))
 
-// The biggest bin holds blocks of this size. Anything bigger will go in the overflow bin.
-#define BIGGEST_BINNED_SIZE 512
+// Past the small bins, each power of two is split into this many geometric bins, each holding a
+// range of sizes. Must be a power of two, 1 << GEOMETRIC_SPLIT_LOG.
+#define GEOMETRIC_SPLIT_LOG 2
+#define GEOMETRIC_SPLITS    (1 << GEOMETRIC_SPLIT_LOG)
 
-// How many bins there are. There's an "underflow" bin (bin 0) and an overflow bin (the last bin).
-// That's where the '2' comes from in this formula.
-#define NUM_BINS            (2 + ((BIGGEST_BINNED_SIZE - MINIMUM_ALLOCATION) / SIZE_MULTIPLE))
+// Blocks this big or bigger go in the overflow bin. It has to be a power of two,
+// 1 << BIGGEST_GEOMETRIC_LOG.
+#define BIGGEST_GEOMETRIC_LOG  22
+#define BIGGEST_GEOMETRIC_SIZE (1 << BIGGEST_GEOMETRIC_LOG)
+
+// How many geometric bins there are.
+#define NUM_GEOMETRIC_BINS  ((BIGGEST_GEOMETRIC_LOG - BIGGEST_BINNED_LOG) * GEOMETRIC_SPLITS)
+
+// The geometric bins for sizes below 1 << CLASS_TABLE_LOG can be given other boundaries with
+// my_malloc_set_size_classes, after which one lookup in a table with an entry per SIZE_MULTIPLE
+// bytes maps a size to its bin. The bins above that keep the formula.
+#define CLASS_TABLE_LOG     16
+#define CLASS_TABLE_SIZE    (1 << CLASS_TABLE_LOG)
+
+// How many of the geometric bins the table covers.
+#define NUM_TABLE_CLASSES   ((CLASS_TABLE_LOG - BIGGEST_BINNED_LOG) * GEOMETRIC_SPLITS)
+
+// While sizes are being sampled, one allocation in this many per thread is counted.
+#ifndef SIZE_SAMPLE_PERIOD
+#define SIZE_SAMPLE_PERIOD  16
+#endif
+
+// my_malloc_tune_size_classes gives a sampled size a class of its own if it's at least one in this
+// many of the samples.
+#ifndef TUNED_CLASS_SHARE
+#define TUNED_CLASS_SHARE   100
+#endif
+
+// How many bins there are: the small bins, the geometric bins, and the overflow bin (the last bin).
+#define NUM_BINS            (NUM_SMALL_BINS + NUM_GEOMETRIC_BINS + 1)
 
 // The index of the overflow bin.
 #define OVERFLOW_BIN        (NUM_BINS - 1)
 
-// How many bytes the block header is, in a USED block.
+// How many bins each word of the bin bitmap covers.
+#define BITMAP_WORD_BITS    64
+
+// How many words the bin bitmap needs to have one bit per bin.
+#define BITMAP_WORDS        ((NUM_BINS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+// How many bytes the block header is, in a USED block. This is the distance from a block to its
+// data, but the first word (prev_size) overlaps the end of the previous block's data, so it isn't
+// all overhead.
 // NEVER USE sizeof(BlockHeader) in your calculations! Use this instead.
 #define BLOCK_HEADER_SIZE   offsetof(BlockHeader, prev_free)
 
-// The smallest number of bytes a block (including header and data) can be.
-#define MINIMUM_BLOCK_SIZE  (MINIMUM_ALLOCATION + BLOCK_HEADER_SIZE)
+// How many bytes a block costs on top of its data: just its size word. The next block starts this
+// far past the end of this block's data, minus the overlapping prev_size.
+#define BLOCK_OVERHEAD      (BLOCK_HEADER_SIZE - sizeof(size_t))
+
+// The smallest number of bytes a block (including overhead and data) can be.
+#define MINIMUM_BLOCK_SIZE  (MINIMUM_ALLOCATION + BLOCK_OVERHEAD)
+
+// The biggest request that can be allocated. Anything bigger would wrap around once it's rounded
+// up and given room for its overhead and a block split off after it.
+#define MAX_ALLOCATION      (UINT_MAX - (SIZE_MULTIPLE - 1) - BLOCK_OVERHEAD - MINIMUM_BLOCK_SIZE)
+
+// How far into a segment its first block starts: past the segment header, padded so the block's
+// data is aligned to SIZE_MULTIPLE.
+#define SEGMENT_HEADER_SIZE (((sizeof(Segment) + BLOCK_HEADER_SIZE + (SIZE_MULTIPLE - 1)) & \
+	~(SIZE_MULTIPLE - 1)) - BLOCK_HEADER_SIZE)
+
+// How many bytes a segment costs on top of its blocks: the segment header, the first block's
+// header and the fence's size word.
+#define SEGMENT_OVERHEAD    (SEGMENT_HEADER_SIZE + BLOCK_HEADER_SIZE + BLOCK_OVERHEAD)
+
+// Once the free block at the top of the heap is bigger than this, my_free gives the excess back to
+// the kernel. Can be changed at runtime with my_mallopt(MY_M_TRIM_THRESHOLD, ...).
+#ifndef DEFAULT_TRIM_THRESHOLD
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+#endif
+
+// How many extra bytes to ask for on every heap growth, and to keep when trimming. Can be changed
+// at runtime with my_mallopt(MY_M_TOP_PAD, ...).
+#ifndef DEFAULT_TOP_PAD
+#define DEFAULT_TOP_PAD     0
+#endif
+
+// The heap grows in multiples of this many bytes, and the break is kept aligned to it, so most
+// allocations are carved from heap->top without a syscall. Can be changed at runtime with
+// my_mallopt(MY_M_GROW_CHUNK, ...); it must be a power of two.
+#ifndef DEFAULT_GROW_CHUNK
+#define DEFAULT_GROW_CHUNK  (64 * 1024)
+#endif
+
+// How much address space each segment of a heap that grows with mmap reserves to grow into. Its
+// pages only take up memory once they're used.
+#ifndef MAPPED_SEGMENT_SIZE
+#define MAPPED_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+
+// Once this many more bytes of whole pages inside free blocks are dirty than there were after the
+// last purge, my_free gives back the pages of the blocks that have stayed free since then. 0
+// turns automatic purging off. Can be changed at runtime with my_mallopt(MY_M_PURGE_THRESHOLD,
+// ...).
+#ifndef DEFAULT_PURGE_THRESHOLD
+#define DEFAULT_PURGE_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+// How a purge gives pages back. MADV_FREE is cheaper, but the pages only leave the resident set
+// once the kernel is short of memory.
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE        MADV_DONTNEED
+#endif
+
+// Allocations of at least this many bytes get their own mmap instead of going on the heap, and are
+// munmap'd as soon as they're freed. Can be changed at runtime with my_mallopt(MY_M_MMAP_THRESHOLD,
+// ...).
+#ifndef DEFAULT_MMAP_THRESHOLD
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+#endif
+
+// Freed blocks up to this many bytes go in a fast bin without being coalesced, until an
+// allocation can't otherwise be met or the heap is trimmed. 0 turns deferred coalescing off. Can be
+// changed at runtime with my_mallopt(MY_M_MXFAST, ...), up to BIGGEST_BINNED_SIZE.
+#ifndef DEFAULT_MXFAST
+#define DEFAULT_MXFAST      0
+#endif
+
+// How many blocks each fast bin holds before frees go back to coalescing right away. This bounds
+// how long a consolidation pass can take.
+#ifndef FAST_BIN_LIMIT
+#define FAST_BIN_LIMIT      256
+#endif
+
+// Statistics are kept unless you build with -DMY_MALLOC_NO_STATS, which compiles every counter out.
+// These index Stats.counters.
+#define STAT_BYTES_IN_USE      0  // Usable bytes in allocated blocks.
+#define STAT_BYTES_HEAP        1  // Bytes in heap segments, sbrk'd or mmap'd.
+#define STAT_BYTES_MMAPPED     2  // Bytes in mmap'd blocks and slab pages.
+#define STAT_MALLOCS           3
+#define STAT_FREES             4
+#define STAT_SPLITS            5
+#define STAT_COALESCES         6
+#define STAT_SBRK_CALLS        7
+#define STAT_BRK_CALLS         8
+#define STAT_MMAP_CALLS        9
+#define STAT_MUNMAP_CALLS      10
+#define STAT_OVERFLOW_SEARCHES 11 // Searches of the overflow tree or a geometric bin's list.
+#define STAT_OVERFLOW_STEPS    12 // Blocks looked at during those searches.
+#define STAT_PURGED_BYTES      13 // Bytes of free blocks' pages given back with madvise.
+#define NUM_STATS              14
+
+#if defined(MY_MALLOC_NO_STATS)
+
+#define STAT_ADD(stat, n)          ((void)0)
+#define BIN_STAT_ADD(bin_index, n) ((void)0)
+
+#elif defined(MY_MALLOC_THREADS)
+
+// Each thread only ever writes its own counters, so a relaxed load and store is enough, which
+// costs the same as a plain add. Readers may see a slightly stale value.
+#define STAT_ADD(stat, n) atomic_store_explicit(&thread_stats.counters[stat], \
+	atomic_load_explicit(&thread_stats.counters[stat], memory_order_relaxed) + (n), \
+	memory_order_relaxed)
+#define BIN_STAT_ADD(bin_index, n) (heap->bin_free_counts[bin_index] += (n))
+
+#else
+
+#define STAT_ADD(stat, n)          (stats.counters[stat] += (n))
+#define BIN_STAT_ADD(bin_index, n) (heap->bin_free_counts[bin_index] += (n))
+
+#endif
+
+// Counts an allocation or a free of ptr.
+#define RECORD_MALLOC(ptr) do { STAT_ADD(STAT_MALLOCS, 1); \
+	STAT_ADD(STAT_BYTES_IN_USE, usable_size(ptr)); } while(0)
+#define RECORD_FREE(ptr)   do { STAT_ADD(STAT_FREES, 1); \
+	STAT_ADD(STAT_BYTES_IN_USE, -(long long)usable_size(ptr)); } while(0)
+#define RECORD_MALLOCS(ptrs, n) do { unsigned int i_; \
+	for(i_ = 0; i_ < (n); i_++) RECORD_MALLOC((ptrs)[i_]); } while(0)
+
+// How many bytes each arena chunk holds, if my_arena_create isn't given a size.
+#ifndef DEFAULT_ARENA_CHUNK
+#define DEFAULT_ARENA_CHUNK (64 * 1024)
+#endif
+
+// Thread-safe mode. Build with -DMY_MALLOC_THREADS (and -pthread) to turn it on.
+#ifdef MY_MALLOC_THREADS
+
+// How many freed blocks each thread keeps per small bin before handing some back to bins[].
+#ifndef THREAD_CACHE_LIMIT
+#define THREAD_CACHE_LIMIT  32
+#endif
+
+// How many blocks a thread moves from bins[] into its cache when it misses, including the one
+// it returns.
+#ifndef THREAD_CACHE_REFILL
+#define THREAD_CACHE_REFILL 8
+#endif
+
+// How many thread caches can own blocks at once. Threads past this still get a cache, but their
+// blocks are freed locally by whichever thread frees them.
+#ifndef MAX_THREAD_CACHES
+#define MAX_THREAD_CACHES   1024
+#endif
+
+// Each heap has its own lock, and LOCK_HEAP takes the current one's (see heap below). The
+// default heap's lock doubles as the lock for the slabs, since there's only one set of them.
+#define LOCK_HEAP()         pthread_mutex_lock(&heap->lock)
+#define UNLOCK_HEAP()       pthread_mutex_unlock(&heap->lock)
+#define LOCK_SLABS()        pthread_mutex_lock(&default_heap.lock)
+#define UNLOCK_SLABS()      pthread_mutex_unlock(&default_heap.lock)
+
+// Protects heaps[]. Take it before any heap's lock, never after.
+#define LOCK_HEAP_LIST()    pthread_mutex_lock(&heap_list_lock)
+#define UNLOCK_HEAP_LIST()  pthread_mutex_unlock(&heap_list_lock)
+
+#else
+
+#define LOCK_HEAP()
+#define UNLOCK_HEAP()
+#define LOCK_SLABS()
+#define UNLOCK_SLABS()
+#define LOCK_HEAP_LIST()
+#define UNLOCK_HEAP_LIST()
+
+#endif
+
+// How many heaps there can be at once. A block keeps its heap's index in 8 bits of its header.
+#define MAX_HEAPS           256
+
+// NUMA mode. Build with -DMY_MALLOC_NUMA (on top of -DMY_MALLOC_THREADS) to give every NUMA node
+// a heap of its own. Each thread allocates from the heap of the node it first ran on, and a freed
+// block goes back to whichever heap it came from.
+#ifdef MY_MALLOC_NUMA
+
+#ifndef MY_MALLOC_THREADS
+#error "MY_MALLOC_NUMA needs MY_MALLOC_THREADS"
+#endif
+
+// Threads on nodes from this one up use the default heap.
+#ifndef MAX_NUMA_NODES
+#define MAX_NUMA_NODES      64
+#endif
+
+// mbind's policy for "put pages on this node if it has room", from <numaif.h>, which only
+// comes with libnuma.
+#define NUMA_MPOL_PREFERRED 1
+
+#endif
+
+// Huge page mode. Build with -DMY_MALLOC_HUGEPAGES to have every heap, the default one included,
+// grow with mmap'd segments aligned to huge pages and advised MADV_HUGEPAGE, so the kernel can
+// back them with transparent huge pages. Heaps then grow and shrink a whole huge page at a time.
+#ifdef MY_MALLOC_HUGEPAGES
+
+// How big a huge page is. Segments start on a multiple of this, and MAPPED_SEGMENT_SIZE must be
+// one too.
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+#endif
+
+#define DEFAULT_HEAP_MAPPED 1
+
+#else
+
+#define DEFAULT_HEAP_MAPPED 0
+
+#endif
+
+// The fit policy for sizes past the small bins. First fit takes the first block in the bins above
+// a size's own bin, which all fit, and only searches its own bin's list if they're empty. Best fit
+// (-DMY_MALLOC_BEST_FIT) searches its own bin first for the smallest block that fits, which wastes
+// less memory but looks at more blocks.
+#ifdef MY_MALLOC_BEST_FIT
+#define BEST_FIT 1
+#else
+#define BEST_FIT 0
+#endif
+
+// Hardened mode. Build with -DMY_MALLOC_HARDENED to turn on every check below, or with just the
+// flags of the ones you want. A check that fails prints what it found and aborts, since the heap
+// can't be trusted anymore.
+#ifdef MY_MALLOC_HARDENED
+
+// The singly linked lists (fast bins, thread caches and remote frees) keep their links encoded,
+// and a doubly linked bin's neighbors must point back at a block taken out of it.
+#ifndef MY_MALLOC_SAFE_LINKS
+#define MY_MALLOC_SAFE_LINKS
+#endif
+
+// Freeing a block that's already free, or waiting in a fast bin or this thread's cache, is caught.
+#ifndef MY_MALLOC_DOUBLE_FREE_CHECKS
+#define MY_MALLOC_DOUBLE_FREE_CHECKS
+#endif
 
+// Before a block is coalesced, its physical neighbors must be inside its segment and agree with
+// its header.
+#ifndef MY_MALLOC_BOUNDS_CHECKS
+#define MY_MALLOC_BOUNDS_CHECKS
+#endif
+
+#endif
+
+// Slab mode. Build with -DMY_MALLOC_SLABS to turn it on. Small allocations (the sizes of the small
+// bins) then come from pages holding objects of a single size, with no header per
+// object and nothing to split or coalesce.
+#ifdef MY_MALLOC_SLABS
+
+// How big each slab page is. Must be a power of two, since a pointer's page is found by masking.
+#ifndef SLAB_PAGE_SIZE
+#define SLAB_PAGE_SIZE      (64 * 1024)
+#endif
+
+// How much address space to reserve for slab pages, all at once so telling a slab object apart
+// from a heap block is a range check. Pages only use memory once they're handed out.
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE    (1024 * 1024 * 1024UL)
+#endif
+
+// How many words each page's free bitmap needs for the smallest objects.
+#define SLAB_BITMAP_WORDS   ((SLAB_PAGE_SIZE / MINIMUM_ALLOCATION) / BITMAP_WORD_BITS + 1)
+
+#endif
+
+// Trace mode. Build with -DMY_MALLOC_TRACE (and -pthread) so my_malloc_trace_start can record
+// every call to a file.
+#ifdef MY_MALLOC_TRACE
+
+// How many records each thread's ring buffer holds. Must be a power of two.
+#ifndef TRACE_BUFFER_RECORDS
+#define TRACE_BUFFER_RECORDS 4096
+#endif
+
+// How often the writer thread drains the ring buffers to the file.
+#ifndef TRACE_DRAIN_MS
+#define TRACE_DRAIN_MS       10
+#endif
+
+// Records a call if a trace is being written. Put it before a call that frees memory and after
+// one that allocates, so that a block being freed by one thread and reused by another comes out
+// in the right order.
+#define TRACE_CALL(op, address, old_address, size) do { \
+	if(atomic_load_explicit(&tracing, memory_order_relaxed)) \
+		trace_call((op), (address), (old_address), (size)); } while(0)
+#define TRACE_MALLOCS(ptrs, n, size) do { unsigned int j_; \
+	for(j_ = 0; j_ < (n); j_++) TRACE_CALL(MY_TRACE_MALLOC, (ptrs)[j_], NULL, (size)); } while(0)
+
+#else
+
+#define TRACE_CALL(op, address, old_address, size) ((void)0)
+#define TRACE_MALLOCS(ptrs, n, size)               ((void)(size))
+
+#endif
+
+// Blocks use boundary tags instead of physical list pointers. The next physical block is always
+// right after this one's data (see next_phys), and a free block keeps a copy of its size in the
+// next block's prev_size (its footer) so the next block can find it (see prev_phys). A used block
+// never needs its footer, so the next block's prev_size is just more room for its data.
 typedef struct BlockHeader
 {
-	unsigned int size; // The byte size of the data area of this block.
-	int in_use;        // 1 if allocated, 0 if free.
+	// The previous physical block's size. Only valid if prev_in_use is 0; otherwise these bytes
+	// are the end of the previous block's data.
+	size_t prev_size;
+
+	// Everything else about a used block, packed into one word.
+	unsigned int size;            // The byte size of the data area of this block.
+
+	// The thread holding a block reads and writes these without the heap lock, so they're kept
+	// apart from the bits below, which a neighbour's free or coalesce changes under the lock.
+	unsigned int owner       : 15; // In thread-safe mode, the id of the thread cache that allocated it.
+	unsigned int mmapped     : 1; // 1 if this block has its own mmap and isn't part of the heap.
+	unsigned char heap_index;     // Where the heap it belongs to is in heaps[].
 
-	// Doubly-linked list pointers for the previous and next *physical* blocks of memory.
-	// All blocks, allocated or free, must keep track of this for coalescing purposes.
-	struct BlockHeader* prev_phys;
-	struct BlockHeader* next_phys;
+	unsigned int in_use      : 1; // 1 if allocated, 0 if free.
+	unsigned int prev_in_use : 1; // 1 if the previous physical block is allocated, or there isn't one.
+	unsigned int purged      : 1; // 1 if this free block's whole pages have been given back.
+	unsigned int aged        : 1; // 1 if this free block has already lived through a purge.
 
 	// These next two members are only valid if the block is not in use (on a free list).
 	// If the block is in use, the user-allocated data starts here instead!
@@ -51,12 +447,311 @@ typedef struct BlockHeader
 	struct BlockHeader* next_free;
 } BlockHeader;
 
-// Your array of bins.
-BlockHeader* bins[NUM_BINS] = {};
+// The heap is made of segments: runs of memory that sbrk gave us contiguously. Each one starts
+// with this and ends with a fence, a zero-size block that's always in use, so nothing coalesces
+// past its ends. Normally there's only one, but if something else moves the break, we have to
+// start a new one. A heap that grows with mmap starts a new one when the last one's reservation
+// runs out.
+typedef struct Segment
+{
+	struct Segment* prev; // The segment before this one, or NULL.
+	BlockHeader* fence;   // The fence at the end of this segment.
+
+	// For a heap that grows with mmap, the end of the address space mapped for this segment to
+	// grow into. NULL for segments sbrk gave us.
+	void* reserved_end;
+} Segment;
+
+// One of the chunks an arena bump-allocates from. Its data follows right after it.
+typedef struct ArenaChunk
+{
+	struct ArenaChunk* next; // The chunk allocated before this one, or NULL.
+	size_t size;             // How many bytes of data it holds.
+} ArenaChunk;
+
+struct MyArena
+{
+	ArenaChunk* chunks;      // Every chunk, newest first.
+	ArenaChunk* current;     // The chunk being bumped through. Big allocations get their own.
+	char* bump;              // Where the next allocation in current goes.
+	char* end;               // The end of current's data.
+	unsigned int chunk_size; // How big new chunks are.
+};
+
+// Blocks in the overflow bin are kept in a red-black tree ordered by size, then by address, so
+// my_malloc can find the best fit in O(log n). The tree reuses prev_free as the left child and
+// next_free as the right child. The parent and color are stored right after them, which always
+// fits since overflow blocks are at least BIGGEST_GEOMETRIC_SIZE.
+typedef struct OverflowNode
+{
+	BlockHeader block;
+	struct BlockHeader* parent;
+	int red; // 1 if red, 0 if black.
+} OverflowNode;
+
+// Everything about one heap: its bins, its segments and the top of its last segment. The default
+// heap grows with sbrk, unless it's built for huge pages. In NUMA mode every node also gets a heap
+// of its own, which grows with segments mmap'd and bound to that node, and so does every heap
+// made by my_heap_create.
+typedef struct MyHeap
+{
+	// The bins. bins[OVERFLOW_BIN] is the root of the overflow tree, not a list.
+	BlockHeader* bins[NUM_BINS];
+
+	// One bit per bin. A set bit means that bin's free list is non-empty, so finding the next
+	// usable bin is a find-first-set instead of a walk over bins[].
+	uint64_t bin_bitmap[BITMAP_WORDS];
+
+	// The LAST segment on the heap, the one the break is at the end of for the default heap.
+	// This is used to keep track of when you should contract the heap.
+	Segment* segment;
+
+	// The free block at the end of segment, or NULL if the last block there is in use. It is
+	// never in a bin, so my_malloc only carves from it once no binned block fits.
+	BlockHeader* top;
+
+	// Everything in top from this address up is still zero from the kernel, so my_calloc doesn't
+	// have to clear blocks carved from there. It never points below top itself.
+	void* top_clean;
+
+	// Freed small blocks whose coalescing is being put off, one stack per small bin, linked
+	// through next_free. They stay marked in_use, so nothing coalesces with them until
+	// consolidate_fast_bins.
+	BlockHeader* fast_bins[NUM_SMALL_BINS];
+	unsigned int fast_counts[NUM_SMALL_BINS];
+
+	// How many blocks are in all the fast bins together.
+	unsigned int fast_block_count;
+
+	// How many bytes of whole pages inside binned blocks haven't been purged, and the least
+	// there have been since the last purge. The top isn't counted; trimming takes care of it.
+	unsigned long long dirty_bytes;
+	unsigned long long dirty_low;
+
+#ifndef MY_MALLOC_NO_STATS
+	// How many free blocks are in each bin.
+	long long bin_free_counts[NUM_BINS];
+#endif
+
+#ifdef MY_MALLOC_THREADS
+	// Protects everything else here. The thread caches never need it.
+	pthread_mutex_t lock;
+#endif
+
+	unsigned int index; // Where it is in heaps[]. Its blocks keep this in their headers.
+	int mapped;         // 1 if it grows with mmap instead of sbrk.
+	int handle;         // 1 if it was made by my_heap_create.
+	int node;           // The NUMA node its memory is bound to, or -1 for none.
+} Heap;
+
+// The heap everything in this file that works on "the heap" uses. Each public function points
+// it at the right heap before taking that heap's lock. It's the default heap unless something
+// points it elsewhere.
+#ifdef MY_MALLOC_THREADS
+Heap default_heap = {.lock = PTHREAD_MUTEX_INITIALIZER, .mapped = DEFAULT_HEAP_MAPPED,
+	.node = -1};
+__thread Heap* heap = &default_heap;
+#else
+Heap default_heap = {.mapped = DEFAULT_HEAP_MAPPED, .node = -1};
+Heap* heap = &default_heap;
+#endif
+
+// Every heap, by index. Slot 0 is the default heap.
+Heap* heaps[MAX_HEAPS] = {&default_heap};
+
+#ifdef MY_MALLOC_NUMA
+
+// Every node's heap, once a thread on that node has needed it. Protected by the heap list lock.
+Heap* node_heaps[MAX_NUMA_NODES];
+
+#endif
+
+// The highest we've ever moved the break to.
+void* break_high_water = NULL;
+
+// See my_mallopt.
+unsigned int trim_threshold = DEFAULT_TRIM_THRESHOLD;
+unsigned int purge_threshold = DEFAULT_PURGE_THRESHOLD;
+unsigned int top_pad = DEFAULT_TOP_PAD;
+unsigned int grow_chunk = DEFAULT_GROW_CHUNK;
+unsigned int mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+unsigned int fast_max = DEFAULT_MXFAST;
+
+// See my_malloc_set_size_classes. While custom_size_classes is 1, size_classes[size /
+// SIZE_MULTIPLE] is the bin of every size from BIGGEST_BINNED_SIZE up to CLASS_TABLE_SIZE, and
+// class_min_sizes[bin - NUM_SMALL_BINS] the smallest size in each of those bins. Only changed with
+// every heap locked.
+int custom_size_classes = 0;
+unsigned char size_classes[CLASS_TABLE_SIZE / SIZE_MULTIPLE];
+unsigned int class_min_sizes[NUM_TABLE_CLASSES];
+
+_Static_assert(NUM_BINS <= 256, "size_classes holds bin indexes in a byte");
+_Static_assert(MY_MAX_SIZE_CLASSES < NUM_TABLE_CLASSES, "the table needs room for other classes");
+
+// See my_malloc_sample_sizes. How many sampled allocations were of each size below
+// CLASS_TABLE_SIZE, by size / SIZE_MULTIPLE.
+_Atomic int sampling_sizes = 0;
+#ifdef MY_MALLOC_THREADS
+_Atomic unsigned int size_samples[CLASS_TABLE_SIZE / SIZE_MULTIPLE];
+__thread unsigned int sample_countdown = 0;
+#else
+unsigned int size_samples[CLASS_TABLE_SIZE / SIZE_MULTIPLE];
+unsigned int sample_countdown = 0;
+#endif
+
+#ifdef MY_MALLOC_SLABS
+
+// The header at the start of every slab page. The objects follow it, packed at object_size apart.
+typedef struct SlabPage
+{
+	unsigned int bin_index;   // The bin whose size this page's objects are.
+	unsigned int object_size; // The byte size of each object.
+	unsigned int capacity;    // How many objects fit in the page.
+	unsigned int free_count;  // How many of them are free.
+	unsigned int untouched;   // Objects from this index on have never been handed out, so are zero.
+	unsigned int search_from; // No word of free_bitmap before this one has a set bit.
+
+	// Links for the list of pages in this bin with free objects, or for the list of empty pages.
+	struct SlabPage* prev_partial;
+	struct SlabPage* next_partial;
+
+	// One bit per object. A set bit means it's free.
+	uint64_t free_bitmap[SLAB_BITMAP_WORDS];
+} SlabPage;
+
+// The reserved slab address range, and how much of it has been handed out as pages so far.
+char* slab_region = NULL;
+size_t slab_region_used = 0;
+
+// For every small bin, its pages that have at least one free object.
+SlabPage* slab_partial[NUM_SMALL_BINS] = {};
+
+// Whole pages nobody is using, ready for any size. Their memory has been given back.
+SlabPage* slab_free_pages = NULL;
+
+#endif
+
+#ifdef MY_MALLOC_THREADS
+
+pthread_mutex_t heap_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread keeps its own stack of recently freed blocks for every small bin, linked through
+// next_free. Cached blocks stay marked in_use, so coalesce never touches them.
+typedef struct ThreadCache
+{
+	BlockHeader* blocks[NUM_SMALL_BINS];
+	unsigned int counts[NUM_SMALL_BINS];
+	int registered;    // 1 once the exit destructor is set up for this thread.
+	int shutting_down; // 1 once it has run, so later frees and allocations skip the cache.
+	unsigned short id; // Index into remote_frees[], or 0 if this thread couldn't get one.
+	Heap* home;        // The heap this thread allocates from, or NULL for the default heap.
+} ThreadCache;
+
+__thread ThreadCache thread_cache;
+
+// Used only to get a destructor call when a thread exits, so its cache goes back to bins[].
+pthread_key_t thread_cache_key;
+pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+// Small blocks freed by a thread that didn't allocate them are pushed onto the owner's remote
+// list with a single CAS, linked through next_free. The owner takes the whole list back the next
+// time its cache misses. Slot 0 is never claimed; it means "no owner".
+typedef struct RemoteFreeList
+{
+	_Atomic(BlockHeader*) head;
+	int claimed; // 1 while a live thread owns this slot. Protected by the default heap's lock.
+
+	// The heap of the threads that have owned this slot. Only threads with the same home claim it
+	// later, so every block on the list belongs to its owner's heap. Also protected by that lock.
+	Heap* home;
+} RemoteFreeList;
 
-// The LAST allocated block on the heap.
-// This is used to keep track of when you should contract the heap.
-BlockHeader* heap_tail = NULL;
+RemoteFreeList remote_frees[MAX_THREAD_CACHES];
+
+#endif
+
+#ifndef MY_MALLOC_NO_STATS
+
+typedef struct Stats
+{
+#ifdef MY_MALLOC_THREADS
+	_Atomic(long long) counters[NUM_STATS];
+#else
+	long long counters[NUM_STATS];
+#endif
+} Stats;
+
+_Static_assert(NUM_BINS <= MY_STATS_BINS, "struct my_stats needs room for every bin");
+_Static_assert(SIZE_MULTIPLE >= 8 && (SIZE_MULTIPLE & (SIZE_MULTIPLE - 1)) == 0,
+	"SIZE_MULTIPLE has to be a power of two, at least 8");
+_Static_assert(MINIMUM_ALLOCATION >= 24 &&
+	(MINIMUM_ALLOCATION + BLOCK_OVERHEAD) % SIZE_MULTIPLE == 0,
+	"the smallest block has to hold a free block's links and footer, and keep blocks aligned");
+_Static_assert(BLOCK_OVERHEAD == 8, "a used block's header has to stay one word");
+_Static_assert(BIGGEST_BINNED_SIZE > MINIMUM_ALLOCATION && BIGGEST_BINNED_LOG < CLASS_TABLE_LOG,
+	"the small bins have to end above the smallest allocation and below the size class table");
+
+#ifdef MY_MALLOC_THREADS
+
+_Static_assert(MAX_THREAD_CACHES <= 1 << 15, "a block keeps its owner in 15 bits of its header");
+
+// Every thread counts on its own, and my_malloc_stats adds them up.
+__thread Stats thread_stats;
+
+// The stats of every live thread that has a thread cache id, by id. Protected by the default
+// heap's lock.
+Stats* live_thread_stats[MAX_THREAD_CACHES];
+
+// What every thread that has exited counted. Protected by the default heap's lock.
+long long exited_thread_stats[NUM_STATS];
+
+#else
+
+Stats stats;
+
+#endif
+
+#endif
+
+#ifdef MY_MALLOC_TRACE
+
+// Every thread writes its calls into a ring buffer of its own without taking any lock. The
+// writer thread drains them all to the trace file every TRACE_DRAIN_MS, and a thread that fills
+// its ring before then drains it itself.
+typedef struct TraceBuffer
+{
+	struct my_trace_record records[TRACE_BUFFER_RECORDS];
+	_Atomic unsigned long head; // How many records the owner has written.
+	_Atomic unsigned long tail; // How many have been drained. Only changed under trace_lock.
+	struct TraceBuffer* next;   // The buffer made before this one, or NULL.
+	int owned;                  // 0 once the owner exits, so a new thread can take it over.
+} TraceBuffer;
+
+// 1 while a trace is being written.
+_Atomic int tracing = 0;
+
+// Protects the trace file, trace_buffers, every buffer's tail and owned, and next_trace_thread.
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int trace_fd = -1;
+uint64_t trace_start;              // When the trace started, in CLOCK_MONOTONIC nanoseconds.
+pthread_t trace_writer;
+int trace_writer_running = 0;
+TraceBuffer* trace_buffers = NULL; // Every buffer ever made, newest first.
+unsigned short next_trace_thread = 0;
+
+// The calling thread's buffer, and the id its records get.
+__thread TraceBuffer* trace_buffer = NULL;
+__thread unsigned short trace_thread;
+
+// 1 while this thread is inside trace_call, in case setting up a buffer allocates.
+__thread int in_trace_call = 0;
+
+// Used only to get a destructor call when a thread exits, so its buffer can be taken over.
+pthread_key_t trace_key;
+pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+#endif
 
 // =================================================================================================
 // Math helpers
@@ -65,7 +760,7 @@ BlockHeader* heap_tail = NULL;
 // Given a pointer and a number of bytes, gives a new pointer that points to the original address
 // plus or minus the offset. The offset can be negative.
 // Since this returns a void*, you have to cast the result to another pointer type to use it.
-void* ptr_add_bytes(void* ptr, int byte_offs)
+void* ptr_add_bytes(void* ptr, ptrdiff_t byte_offs)
 {
 	return (void*)(((char*)ptr) + byte_offs);
 }
@@ -93,10 +788,11 @@ BlockHeader* data_to_block(void* data)
 // Given a data size, gives how many bytes you'd need to allocate for a block to hold it.
 unsigned int data_size_to_block_size(unsigned int data_size)
 {
-	return data_size + BLOCK_HEADER_SIZE;
+	return data_size + BLOCK_OVERHEAD;
 }
 
-// Rounds up a data size to an appropriate size for putting into a bin.
+// Rounds up a data size to an appropriate size for putting into a bin. Whole blocks (data plus
+// overhead) are kept a multiple of SIZE_MULTIPLE so every block stays aligned.
 unsigned int round_up_size(unsigned int data_size)
 {
 	if(data_size == 0)
@@ -104,341 +800,3748 @@ unsigned int round_up_size(unsigned int data_size)
 	else if(data_size < MINIMUM_ALLOCATION)
 		return MINIMUM_ALLOCATION;
 	else
-		return (data_size + (SIZE_MULTIPLE - 1)) & ~(SIZE_MULTIPLE - 1);
+		return ((data_size + BLOCK_OVERHEAD + (SIZE_MULTIPLE - 1)) & ~(SIZE_MULTIPLE - 1)) - BLOCK_OVERHEAD;
 }
 
 // Given a data size in bytes, gives the correct bin index to put it in.
 unsigned int size_to_bin(unsigned int data_size)
 {
-	unsigned int bin = (round_up_size(data_size) - MINIMUM_ALLOCATION) / SIZE_MULTIPLE;
+	unsigned int size = round_up_size(data_size);
 
-	if(bin > OVERFLOW_BIN)
+	if(size <= BIGGEST_BINNED_SIZE)
+		return (size - MINIMUM_ALLOCATION) / SIZE_MULTIPLE;
+
+	if(custom_size_classes && size < CLASS_TABLE_SIZE)
+		return size_classes[size / SIZE_MULTIPLE];
+
+	if(size >= BIGGEST_GEOMETRIC_SIZE)
 		return OVERFLOW_BIN;
-	else
-		return bin;
+
+	// which power of two it's in, then which split of that range, from the next few bits down
+	unsigned int log = 31 - __builtin_clz(size);
+	unsigned int split = (size >> (log - GEOMETRIC_SPLIT_LOG)) & (GEOMETRIC_SPLITS - 1);
+
+	return NUM_SMALL_BINS + (log - BIGGEST_BINNED_LOG) * GEOMETRIC_SPLITS + split;
 }
 
-// links block onto end of physical list
-void link_onto_end(BlockHeader* new_block)
+// Gives the smallest block size the formula puts in the geometric bin with the given index among
+// the geometric bins.
+unsigned int geometric_min_size(unsigned int geometric)
 {
-	if(heap_tail == NULL) {
-		new_block->prev_phys = NULL;
-		new_block->next_phys = NULL;
-		heap_tail = new_block;
-		return;
-	}
+	unsigned int log = BIGGEST_BINNED_LOG + geometric / GEOMETRIC_SPLITS;
 
-	BlockHeader* old_tail = heap_tail;
-	old_tail->next_phys = new_block;
-	new_block->next_phys = NULL;
-	new_block->prev_phys = old_tail;
-	heap_tail = new_block;
+	return (1 << log) + (geometric % GEOMETRIC_SPLITS) * (1 << (log - GEOMETRIC_SPLIT_LOG));
 }
 
-// unlinks block from end of physical list
-void unlink_block() {
+// Gives the smallest block size that can go in a bin.
+unsigned int bin_min_size(unsigned int bin_index)
+{
+	if(bin_index < NUM_SMALL_BINS)
+		return MINIMUM_ALLOCATION + bin_index * SIZE_MULTIPLE;
 
-	if(heap_tail == NULL) {
-		return;
-	}
+	if(bin_index == OVERFLOW_BIN)
+		return BIGGEST_GEOMETRIC_SIZE;
 
-	if(heap_tail->prev_phys == NULL) {
-		heap_tail = NULL;
-		return;
-	}
+	if(custom_size_classes && bin_index < NUM_SMALL_BINS + NUM_TABLE_CLASSES)
+		return class_min_sizes[bin_index - NUM_SMALL_BINS];
 
-	BlockHeader* new_tail = heap_tail->prev_phys;
-	new_tail->next_phys = NULL;
-	heap_tail = new_tail;
+	return geometric_min_size(bin_index - NUM_SMALL_BINS);
 }
 
-// inserts block at the head of appropriate sized bin
-void insert_into_bin(BlockHeader* block) {
+// Gives the first bin whose blocks are all at least data_size bytes. Small bins hold one size
+// each, but a geometric bin can hold blocks smaller than data_size even if data_size maps to it,
+// so those skip ahead to the next bin.
+unsigned int size_to_fit_bin(unsigned int data_size)
+{
+	unsigned int bin = size_to_bin(data_size);
 
-	unsigned int bin_index = size_to_bin(block->size);
+	if(bin < NUM_SMALL_BINS || bin == OVERFLOW_BIN)
+		return bin;
 
-	if(bins[bin_index] == NULL) {
-		block->prev_free = NULL;
-		block->next_free = NULL;
-		bins[bin_index] = block;
-		return;
-	}
+	if(round_up_size(data_size) > bin_min_size(bin))
+		return bin + 1;
+	else
+		return bin;
+}
 
-	BlockHeader* old_head = bins[bin_index];
-	old_head->prev_free = block;
-	block->next_free = old_head;
-	block->prev_free = NULL;
-	bins[bin_index] = block;
+// Gives the system page size.
+unsigned int page_size()
+{
+	static unsigned int size = 0;
 
-}
+	if(size == 0)
+		size = (unsigned int)sysconf(_SC_PAGESIZE);
 
-// removes block from appropriate sized free list
-void remove_block(BlockHeader* block) {
+	return size;
+}
 
-	unsigned int bin_index = size_to_bin(block->size);
+// Rounds a byte count up to a whole number of pages.
+unsigned int round_up_to_pages(unsigned int bytes)
+{
+	return (bytes + (page_size() - 1)) & ~(page_size() - 1);
+}
 
-	// block is only one in the free list
-	if(block->prev_free == NULL && block->next_free == NULL) {
-		bins[bin_index] = NULL;
-		return;
-	}
+// Gives how far apart the boundaries are that pages are handed back to the kernel at, when a heap
+// growing with mmap is trimmed or a free block is purged. In huge page mode that's a whole huge
+// page, so neither ever splits one.
+unsigned int release_unit()
+{
+#ifdef MY_MALLOC_HUGEPAGES
+	return HUGE_PAGE_SIZE;
+#else
+	return page_size();
+#endif
+}
 
-	// block is at the head of the free list, but not the only block
-	if(block->prev_free == NULL && block->next_free != NULL) {
-		bins[bin_index] = block->next_free;
-		block->next_free->prev_free = NULL; // change here
-		return;
-	}
+// =================================================================================================
+// Bin bitmap helpers
+// =================================================================================================
 
-	// block is at the end of the free list
-	if(block->prev_free != NULL && block->next_free == NULL) {
-		BlockHeader* prev_block = block->prev_free;
-		prev_block->next_free = NULL;
-		return;
-	}
+// marks a bin as having at least one free block
+void mark_bin_nonempty(unsigned int bin_index)
+{
+	heap->bin_bitmap[bin_index / BITMAP_WORD_BITS] |= (uint64_t)1 << (bin_index % BITMAP_WORD_BITS);
+}
 
-	// block is a "middle" block
-	if(block->prev_free != NULL && block->next_free != NULL) {
-		BlockHeader* prev_block = block->prev_free;
-		BlockHeader* next_block = block->next_free;
-		prev_block->next_free = next_block;
-		next_block->prev_free = prev_block;
-		return;
-	}
+// marks a bin as having no free blocks
+void mark_bin_empty(unsigned int bin_index)
+{
+	heap->bin_bitmap[bin_index / BITMAP_WORD_BITS] &=
+		~((uint64_t)1 << (bin_index % BITMAP_WORD_BITS));
 }
 
-BlockHeader* coalesce(BlockHeader* block) {
+// Gives the index of the first non-empty bin whose index is >= first_bin, or NUM_BINS if every
+// bin from there on is empty.
+unsigned int find_nonempty_bin(unsigned int first_bin)
+{
+	if(first_bin >= NUM_BINS)
+		return NUM_BINS;
 
-	if(block->prev_phys != NULL && block->next_phys != NULL) {
-		// has both a next and previous neighbor
+	unsigned int word = first_bin / BITMAP_WORD_BITS;
 
-		if(block->prev_phys->in_use == 0 && block->next_phys->in_use == 0) {
-			// coalesce both neighbors
+	// mask off the bins below first_bin in its word
+	uint64_t bits = heap->bin_bitmap[word] & (~(uint64_t)0 << (first_bin % BITMAP_WORD_BITS));
 
-			remove_block(block->next_phys);
-			remove_block(block->prev_phys);
+	while(bits == 0) {
+		word++;
 
-			int new_size = block->prev_phys->size + (block->size + BLOCK_HEADER_SIZE) + (block->next_phys->size + BLOCK_HEADER_SIZE);
-			BlockHeader* coalesced_block = block->prev_phys;
-			coalesced_block->size = new_size;
-			coalesced_block->in_use = 0;
+		if(word >= BITMAP_WORDS)
+			return NUM_BINS;
 
-			coalesced_block->next_phys = block->next_phys->next_phys;
+		bits = heap->bin_bitmap[word];
+	}
 
-			if(coalesced_block->next_phys == NULL) {
-				heap_tail = coalesced_block;
-			} else {
-				coalesced_block->next_phys->prev_phys = coalesced_block;
-			}
-			return coalesced_block;
+	return word * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+}
 
-		} else if(block->prev_phys->in_use == 0 && block->next_phys->in_use == 1) {
-			// coalesce previous neighbor
+// =================================================================================================
+// Overflow tree helpers
+// =================================================================================================
 
-			remove_block(block->prev_phys);
+BlockHeader* tree_parent(BlockHeader* node)
+{
+	return ((OverflowNode*)node)->parent;
+}
 
-			int new_size = block->prev_phys->size + (block->size + BLOCK_HEADER_SIZE);
-			BlockHeader* coalesced_block = block->prev_phys;
-			coalesced_block->size = new_size;
-			coalesced_block->in_use = 0;
+void set_tree_parent(BlockHeader* node, BlockHeader* parent)
+{
+	((OverflowNode*)node)->parent = parent;
+}
 
-			coalesced_block->next_phys = block->next_phys;
-			coalesced_block->next_phys->prev_phys = coalesced_block;
+// NULL leaves count as black.
+int tree_is_red(BlockHeader* node)
+{
+	return node != NULL && ((OverflowNode*)node)->red;
+}
 
-			return coalesced_block;
+void set_tree_red(BlockHeader* node, int red)
+{
+	((OverflowNode*)node)->red = red;
+}
 
-		} else if(block->prev_phys->in_use == 1 && block->next_phys->in_use == 0) {
-			// coalesce next neighbor
+// 1 if a goes before b in the tree: smaller blocks first, address breaks ties.
+int tree_less(BlockHeader* a, BlockHeader* b)
+{
+	return a->size < b->size || (a->size == b->size && a < b);
+}
 
-			remove_block(block->next_phys);
+// puts new_child where old_child was under old_child's parent
+void tree_replace_child(BlockHeader* old_child, BlockHeader* new_child)
+{
+	BlockHeader* parent = tree_parent(old_child);
 
-			int new_size = block->next_phys->size + (block->size + BLOCK_HEADER_SIZE);
-			BlockHeader* coalesced_block = block;
-			coalesced_block->size = new_size;
-			coalesced_block->in_use = 0;
+	if(parent == NULL)
+		heap->bins[OVERFLOW_BIN] = new_child;
+	else if(parent->prev_free == old_child)
+		parent->prev_free = new_child;
+	else
+		parent->next_free = new_child;
 
-			coalesced_block->next_phys = block->next_phys->next_phys;
+	if(new_child != NULL)
+		set_tree_parent(new_child, parent);
+}
 
-			if(coalesced_block->next_phys == NULL) {
-				heap_tail = coalesced_block;
-			} else {
-				coalesced_block->next_phys->prev_phys = coalesced_block;
-			}
-			return coalesced_block;
-		}
+void tree_rotate_left(BlockHeader* node)
+{
+	BlockHeader* pivot = node->next_free;
 
-	} else if(block->prev_phys != NULL && block->next_phys == NULL) {
-		// only has a previous neighbor
-		if(block->prev_phys->in_use == 0) {
-			// coalesce previous neighbor
-			remove_block(block->prev_phys);
+	node->next_free = pivot->prev_free;
 
-			int new_size = block->prev_phys->size + (block->size + BLOCK_HEADER_SIZE);
-			BlockHeader* coalesced_block = block->prev_phys;
-			coalesced_block->size = new_size;
-			coalesced_block->in_use = 0;
+	if(pivot->prev_free != NULL)
+		set_tree_parent(pivot->prev_free, node);
 
-			coalesced_block->next_phys = NULL;
-			heap_tail = coalesced_block;
-			return coalesced_block;
-		}
+	tree_replace_child(node, pivot);
+	pivot->prev_free = node;
+	set_tree_parent(node, pivot);
+}
 
-	} else if(block->prev_phys == NULL && block->next_phys != NULL) {
-	 	// only has a next neighbor
-		if(block->next_phys->in_use == 0) {
-			// coalesce next neighbor
-			remove_block(block->next_phys);
+void tree_rotate_right(BlockHeader* node)
+{
+	BlockHeader* pivot = node->prev_free;
 
-			int new_size = block->next_phys->size + (block->size + BLOCK_HEADER_SIZE);
-			BlockHeader* coalesced_block = block;
-			coalesced_block->size = new_size;
-			coalesced_block->in_use = 0;
+	node->prev_free = pivot->next_free;
 
-			coalesced_block->next_phys = block->next_phys->next_phys;
+	if(pivot->next_free != NULL)
+		set_tree_parent(pivot->next_free, node);
 
-			if(coalesced_block->next_phys == NULL) {
-				heap_tail = coalesced_block;
-			} else {
-				coalesced_block->next_phys->prev_phys = coalesced_block;
-			}
-			return coalesced_block;
-		}
-	}
-	return block;
+	tree_replace_child(node, pivot);
+	pivot->next_free = node;
+	set_tree_parent(node, pivot);
 }
 
-BlockHeader* split_block(BlockHeader* block, int allocation_size) {
+// inserts block into the overflow tree
+void tree_insert(BlockHeader* block)
+{
+	BlockHeader* parent = NULL;
+	BlockHeader* current = heap->bins[OVERFLOW_BIN];
 
-	int old_block_size = block->size;
+	while(current != NULL) {
+		parent = current;
+		current = tree_less(block, current) ? current->prev_free : current->next_free;
+	}
 
-	// remove unsplit block from appropriate free list
-	remove_block(block);
+	block->prev_free = NULL;
+	block->next_free = NULL;
+	set_tree_parent(block, parent);
+	set_tree_red(block, 1);
+
+	if(parent == NULL)
+		heap->bins[OVERFLOW_BIN] = block;
+	else if(tree_less(block, parent))
+		parent->prev_free = block;
+	else
+		parent->next_free = block;
+
+	// fix any red-red violation on the way back up
+	BlockHeader* node = block;
+
+	while(tree_is_red(tree_parent(node))) {
+		parent = tree_parent(node);
+		BlockHeader* grandparent = tree_parent(parent);
+
+		if(parent == grandparent->prev_free) {
+			BlockHeader* uncle = grandparent->next_free;
+
+			if(tree_is_red(uncle)) {
+				set_tree_red(parent, 0);
+				set_tree_red(uncle, 0);
+				set_tree_red(grandparent, 1);
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->next_free) {
+				tree_rotate_left(parent);
+				node = parent;
+				parent = tree_parent(node);
+			}
+
+			set_tree_red(parent, 0);
+			set_tree_red(grandparent, 1);
+			tree_rotate_right(grandparent);
+		} else {
+			BlockHeader* uncle = grandparent->prev_free;
+
+			if(tree_is_red(uncle)) {
+				set_tree_red(parent, 0);
+				set_tree_red(uncle, 0);
+				set_tree_red(grandparent, 1);
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->prev_free) {
+				tree_rotate_right(parent);
+				node = parent;
+				parent = tree_parent(node);
+			}
+
+			set_tree_red(parent, 0);
+			set_tree_red(grandparent, 1);
+			tree_rotate_left(grandparent);
+		}
+	}
+
+	set_tree_red(heap->bins[OVERFLOW_BIN], 0);
+}
+
+// restores the black height after removing a black node. node may be NULL, which is why its
+// parent is passed separately.
+void tree_remove_fixup(BlockHeader* node, BlockHeader* parent)
+{
+	while(node != heap->bins[OVERFLOW_BIN] && !tree_is_red(node)) {
+		if(node == parent->prev_free) {
+			BlockHeader* sibling = parent->next_free;
+
+			if(tree_is_red(sibling)) {
+				set_tree_red(sibling, 0);
+				set_tree_red(parent, 1);
+				tree_rotate_left(parent);
+				sibling = parent->next_free;
+			}
+
+			if(!tree_is_red(sibling->prev_free) && !tree_is_red(sibling->next_free)) {
+				set_tree_red(sibling, 1);
+				node = parent;
+				parent = tree_parent(node);
+			} else {
+				if(!tree_is_red(sibling->next_free)) {
+					set_tree_red(sibling->prev_free, 0);
+					set_tree_red(sibling, 1);
+					tree_rotate_right(sibling);
+					sibling = parent->next_free;
+				}
+
+				set_tree_red(sibling, tree_is_red(parent));
+				set_tree_red(parent, 0);
+				set_tree_red(sibling->next_free, 0);
+				tree_rotate_left(parent);
+				node = heap->bins[OVERFLOW_BIN];
+			}
+		} else {
+			BlockHeader* sibling = parent->prev_free;
+
+			if(tree_is_red(sibling)) {
+				set_tree_red(sibling, 0);
+				set_tree_red(parent, 1);
+				tree_rotate_right(parent);
+				sibling = parent->prev_free;
+			}
+
+			if(!tree_is_red(sibling->prev_free) && !tree_is_red(sibling->next_free)) {
+				set_tree_red(sibling, 1);
+				node = parent;
+				parent = tree_parent(node);
+			} else {
+				if(!tree_is_red(sibling->prev_free)) {
+					set_tree_red(sibling->next_free, 0);
+					set_tree_red(sibling, 1);
+					tree_rotate_left(sibling);
+					sibling = parent->prev_free;
+				}
+
+				set_tree_red(sibling, tree_is_red(parent));
+				set_tree_red(parent, 0);
+				set_tree_red(sibling->prev_free, 0);
+				tree_rotate_right(parent);
+				node = heap->bins[OVERFLOW_BIN];
+			}
+		}
+	}
+
+	if(node != NULL)
+		set_tree_red(node, 0);
+}
+
+// removes block from the overflow tree
+void tree_remove(BlockHeader* block)
+{
+	BlockHeader* child;
+	BlockHeader* child_parent;
+	int removed_red = tree_is_red(block);
+
+	if(block->prev_free == NULL) {
+		child = block->next_free;
+		child_parent = tree_parent(block);
+		tree_replace_child(block, child);
+	} else if(block->next_free == NULL) {
+		child = block->prev_free;
+		child_parent = tree_parent(block);
+		tree_replace_child(block, child);
+	} else {
+		// two children: the in-order successor takes block's place
+		BlockHeader* successor = block->next_free;
+
+		while(successor->prev_free != NULL)
+			successor = successor->prev_free;
+
+		removed_red = tree_is_red(successor);
+		child = successor->next_free;
+
+		if(tree_parent(successor) == block) {
+			child_parent = successor;
+		} else {
+			child_parent = tree_parent(successor);
+			tree_replace_child(successor, child);
+			successor->next_free = block->next_free;
+			set_tree_parent(successor->next_free, successor);
+		}
+
+		tree_replace_child(block, successor);
+		successor->prev_free = block->prev_free;
+		set_tree_parent(successor->prev_free, successor);
+		set_tree_red(successor, tree_is_red(block));
+	}
+
+	if(!removed_red)
+		tree_remove_fixup(child, child_parent);
+}
+
+// Gives the smallest block in the overflow tree with at least size bytes, picking the lowest
+// address among equal sizes, or NULL if none is big enough.
+BlockHeader* tree_best_fit(unsigned int size)
+{
+	BlockHeader* best = NULL;
+	BlockHeader* current = heap->bins[OVERFLOW_BIN];
+
+	STAT_ADD(STAT_OVERFLOW_SEARCHES, 1);
+
+	while(current != NULL) {
+		STAT_ADD(STAT_OVERFLOW_STEPS, 1);
+
+		if(current->size >= size) {
+			best = current;
+			current = current->prev_free;
+		} else {
+			current = current->next_free;
+		}
+	}
+
+	return best;
+}
+
+// =================================================================================================
+// Boundary tag helpers
+// =================================================================================================
+
+// Gives the block physically after this one. Don't call it on a fence.
+BlockHeader* next_phys(BlockHeader* block)
+{
+	return ptr_add_bytes(block, BLOCK_OVERHEAD + block->size);
+}
+
+// Gives the block physically before this one. Only works if block->prev_in_use is 0.
+BlockHeader* prev_phys(BlockHeader* block)
+{
+	return ptr_add_bytes(block, -(ptrdiff_t)(BLOCK_OVERHEAD + block->prev_size));
+}
+
+// Gives the address just past the end of block's data.
+void* block_end(BlockHeader* block)
+{
+	return ptr_add_bytes(block_to_data(block), block->size);
+}
+
+// Sets up a new heap block's header. The next block's view of it is up to the caller.
+void init_block(BlockHeader* block, unsigned int size, int in_use, int prev_in_use)
+{
+	block->size = size;
+	block->in_use = in_use;
+	block->prev_in_use = prev_in_use;
+	block->mmapped = 0;
+	block->owner = 0;
+	block->heap_index = heap->index;
+	block->purged = 0;
+	block->aged = 0;
+}
+
+// Marks a block as allocated, and tells the next block.
+void mark_used(BlockHeader* block)
+{
+	block->in_use = 1;
+	next_phys(block)->prev_in_use = 1;
+}
+
+// Marks a block as free and writes its footer into the next block.
+void mark_free(BlockHeader* block)
+{
+	BlockHeader* next = next_phys(block);
+
+	block->in_use = 0;
+	next->prev_size = block->size;
+	next->prev_in_use = 0;
+}
+
+// Makes a fence at the given address, right after a block whose in_use is prev_in_use.
+BlockHeader* make_fence(void* where, int prev_in_use)
+{
+	BlockHeader* fence = where;
+	init_block(fence, 0, 1, prev_in_use);
+	return fence;
+}
+
+// Gives the first block in a segment.
+BlockHeader* segment_first_block(Segment* segment)
+{
+	return ptr_add_bytes(segment, SEGMENT_HEADER_SIZE);
+}
+
+// Gives the address just past the end of a segment, where the break is if it's the last one.
+void* segment_end(Segment* segment)
+{
+	return ptr_add_bytes(segment->fence, BLOCK_HEADER_SIZE);
+}
+
+// Gives the heap a heap block belongs to.
+Heap* heap_of(BlockHeader* block)
+{
+	return heaps[block->heap_index];
+}
+
+// Gives the heap the calling thread allocates from.
+Heap* local_heap()
+{
+#ifdef MY_MALLOC_THREADS
+	if(thread_cache.home != NULL)
+		return thread_cache.home;
+#endif
+
+	return &default_heap;
+}
+
+// Stops the program once a hardening check finds the heap corrupted. Nothing can be trusted by
+// then, so it writes its message without allocating anything and aborts.
+void heap_corrupted(const char* what)
+{
+	static const char prefix[] = "my_malloc: ";
+	ssize_t ignored;
+
+	ignored = write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+	ignored = write(STDERR_FILENO, what, strlen(what));
+	ignored = write(STDERR_FILENO, "\n", 1);
+	(void)ignored;
+
+	abort();
+}
+
+// Gives the block after block on a singly linked list: a fast bin, a thread cache or a remote
+// free list, all linked through next_free. With safe links, the link is stored XORed with its
+// own address shifted down (like glibc's safe-linking), so overwriting it can't aim the list at
+// a chosen address without knowing where the heap is, and a garbled one is caught here.
+BlockHeader* list_next(BlockHeader* block)
+{
+#ifdef MY_MALLOC_SAFE_LINKS
+	BlockHeader* next = (BlockHeader*)(((uintptr_t)&block->next_free >> 12) ^
+		(uintptr_t)block->next_free);
+
+	if(((uintptr_t)next & (SIZE_MULTIPLE - 1)) != 0)
+		heap_corrupted("corrupted singly linked free list");
+
+	return next;
+#else
+	return block->next_free;
+#endif
+}
+
+// Links next after block on a singly linked list, see list_next.
+void set_list_next(BlockHeader* block, BlockHeader* next)
+{
+#ifdef MY_MALLOC_SAFE_LINKS
+	block->next_free = (BlockHeader*)(((uintptr_t)&block->next_free >> 12) ^ (uintptr_t)next);
+#else
+	block->next_free = next;
+#endif
+}
+
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+
+// Blocks in a fast bin or a thread cache are still marked in use, so they have this in prev_free
+// instead (like glibc's tcache key). It depends on where the library was loaded, so a program
+// can't easily store it by accident.
+BlockHeader* cached_key()
+{
+	return (BlockHeader*)((uintptr_t)&heaps ^ 0x9E3779B97F4A7C15ULL);
+}
+
+// Aborts if block, which carries the cached key, really is on the singly linked list at head. A
+// live block that happens to hold the key in its first word is just freed as usual.
+void check_not_on_list(BlockHeader* block, BlockHeader* head)
+{
+	for(; head != NULL; head = list_next(head)) {
+		if(head == block)
+			heap_corrupted("double free of a cached block");
+	}
+}
+
+#endif
+
+// Checks a pointer that's about to be freed or reallocated, in hardened builds: its block must
+// still be in use and belong to a heap that exists.
+void check_block_to_free(BlockHeader* block)
+{
+	(void)block; // with neither check compiled in, there's nothing to look at
+
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+	if(!block->in_use)
+		heap_corrupted("double free");
+#endif
+
+#ifdef MY_MALLOC_BOUNDS_CHECKS
+	if(!block->mmapped && heap_of(block) == NULL)
+		heap_corrupted("free of a block from no heap");
+#endif
+}
+
+// Gives how many bytes of whole pages (whole huge pages in huge page mode) a free block holds past
+// its links and before its footer, which is what purging it gives back.
+unsigned int purgeable_bytes(BlockHeader* block) {
+
+	uintptr_t unit = release_unit();
+
+	if(block->size < unit)
+		return 0;
+
+	uintptr_t from = ((uintptr_t)block + sizeof(OverflowNode) + (unit - 1)) & ~(unit - 1);
+	uintptr_t to = (uintptr_t)next_phys(block) & ~(unit - 1);
+
+	return to > from ? (unsigned int)(to - from) : 0;
+}
+
+// inserts block at the head of appropriate sized bin
+void insert_into_bin(BlockHeader* block) {
+
+	unsigned int bin_index = size_to_bin(block->size);
+
+	BIN_STAT_ADD(bin_index, 1);
+
+	if(!block->purged)
+		heap->dirty_bytes += purgeable_bytes(block);
+
+	if(bin_index == OVERFLOW_BIN) {
+		tree_insert(block);
+		mark_bin_nonempty(bin_index);
+		return;
+	}
+
+	if(heap->bins[bin_index] == NULL) {
+		block->prev_free = NULL;
+		block->next_free = NULL;
+		heap->bins[bin_index] = block;
+		mark_bin_nonempty(bin_index);
+		return;
+	}
+
+	BlockHeader* old_head = heap->bins[bin_index];
+	old_head->prev_free = block;
+	block->next_free = old_head;
+	block->prev_free = NULL;
+	heap->bins[bin_index] = block;
+
+}
+
+// removes block from appropriate sized free list (or the overflow tree)
+void remove_block(BlockHeader* block) {
+
+	unsigned int bin_index = size_to_bin(block->size);
+
+	BIN_STAT_ADD(bin_index, -1);
+
+	if(!block->purged) {
+		heap->dirty_bytes -= purgeable_bytes(block);
+
+		if(heap->dirty_bytes < heap->dirty_low)
+			heap->dirty_low = heap->dirty_bytes;
+	}
+
+	// whatever it's used for next will dirty it
+	block->purged = 0;
+	block->aged = 0;
+
+	if(bin_index == OVERFLOW_BIN) {
+		tree_remove(block);
+
+		if(heap->bins[bin_index] == NULL)
+			mark_bin_empty(bin_index);
+		return;
+	}
+
+#ifdef MY_MALLOC_SAFE_LINKS
+	// only the head has no prev_free, and every neighbor has to point back
+	if((heap->bins[bin_index] == block ? block->prev_free != NULL :
+		block->prev_free == NULL || block->prev_free->next_free != block) ||
+		(block->next_free != NULL && block->next_free->prev_free != block))
+		heap_corrupted("corrupted doubly linked free list");
+#endif
+
+	// block is only one in the free list
+	if(block->prev_free == NULL && block->next_free == NULL) {
+		heap->bins[bin_index] = NULL;
+		mark_bin_empty(bin_index);
+		return;
+	}
+
+	// block is at the head of the free list, but not the only block
+	if(block->prev_free == NULL && block->next_free != NULL) {
+		heap->bins[bin_index] = block->next_free;
+		block->next_free->prev_free = NULL; // change here
+		return;
+	}
+
+	// block is at the end of the free list
+	if(block->prev_free != NULL && block->next_free == NULL) {
+		BlockHeader* prev_block = block->prev_free;
+		prev_block->next_free = NULL;
+		return;
+	}
+
+	// block is a "middle" block
+	if(block->prev_free != NULL && block->next_free != NULL) {
+		BlockHeader* prev_block = block->prev_free;
+		BlockHeader* next_block = block->next_free;
+		prev_block->next_free = next_block;
+		next_block->prev_free = prev_block;
+		return;
+	}
+}
+
+// takes a free neighbor out of its bin, or out of heap->top if it's the top block
+void take_free_block(BlockHeader* block) {
+
+	if(block == heap->top)
+		heap->top = NULL;
+	else
+		remove_block(block);
+}
+
+#ifdef MY_MALLOC_BOUNDS_CHECKS
+
+// Gives the segment of the heap that block starts in, or NULL if it isn't in any of them.
+Segment* segment_of(BlockHeader* block) {
+
+	Segment* segment;
+
+	for(segment = heap->segment; segment != NULL; segment = segment->prev) {
+		if((char*)block >= (char*)segment_first_block(segment) &&
+			(char*)block < (char*)segment->fence)
+			return segment;
+	}
+
+	return NULL;
+}
+
+// Aborts unless a used block and its physical neighbors are all inside its segment and agree with
+// each other: the next block knows this one is in use, and a free neighbor's size and footer
+// match where its neighbors really are.
+void check_neighbors(BlockHeader* block) {
+
+	Segment* segment = segment_of(block);
+
+	if(segment == NULL)
+		heap_corrupted("free of a pointer outside the heap");
+
+	BlockHeader* next = next_phys(block);
+
+	if((char*)next > (char*)segment->fence || !next->prev_in_use)
+		heap_corrupted("corrupted size of a block being freed");
+
+	if(!next->in_use && ((char*)next_phys(next) > (char*)segment->fence ||
+		next_phys(next)->prev_size != next->size))
+		heap_corrupted("corrupted size of the next free block");
+
+	if(!block->prev_in_use) {
+		BlockHeader* prev = prev_phys(block);
+
+		if((char*)prev < (char*)segment_first_block(segment) || prev->in_use ||
+			next_phys(prev) != block)
+			heap_corrupted("corrupted footer of the previous free block");
+	}
+}
+
+#endif
+
+// Merges a used block that's about to be freed with its free physical neighbors. Gives the merged
+// block, which the caller still has to mark free.
+BlockHeader* coalesce(BlockHeader* block) {
+
+#ifdef MY_MALLOC_BOUNDS_CHECKS
+	check_neighbors(block);
+#endif
+
+	BlockHeader* next = next_phys(block);
+
+	// coalesce next neighbor. Fences are always in use, so this never runs off the segment.
+	if(!next->in_use) {
+		take_free_block(next);
+		block->size += BLOCK_OVERHEAD + next->size;
+		STAT_ADD(STAT_COALESCES, 1);
+	}
+
+	// coalesce previous neighbor
+	if(!block->prev_in_use) {
+		BlockHeader* prev = prev_phys(block);
+		take_free_block(prev);
+		prev->size += BLOCK_OVERHEAD + block->size;
+		block = prev;
+		STAT_ADD(STAT_COALESCES, 1);
+	}
+
+	return block;
+}
+
+BlockHeader* split_block(BlockHeader* block, unsigned int allocation_size) {
+
+	int purged = block->purged, aged = block->aged;
+
+	// remove unsplit block from appropriate free list
+	remove_block(block);
 
 	BlockHeader* allocated_portion = block;
-	BlockHeader* empty_portion = ptr_add_bytes(block, allocation_size+BLOCK_HEADER_SIZE);
-	BlockHeader* next_block = block->next_phys;
+	BlockHeader* empty_portion = ptr_add_bytes(block, allocation_size + BLOCK_OVERHEAD);
+
+	init_block(empty_portion, (block->size - allocation_size) - BLOCK_OVERHEAD, 0, 1);
+
+	// nothing has touched the rest's pages, so it's as clean as the whole block was
+	empty_portion->purged = purged;
+	empty_portion->aged = aged;
+	allocated_portion->size = allocation_size;
+	allocated_portion->in_use = 1;
+
+	// the next block already knows something free is before it, just not its new size
+	next_phys(empty_portion)->prev_size = empty_portion->size;
+
+	// insert empty portion of split block to appropriate bin
+	insert_into_bin(empty_portion);
+	STAT_ADD(STAT_SPLITS, 1);
+
+	return allocated_portion;
+}
+
+// Allocates size bytes from a free block that's big enough, splitting off the rest if it's big
+// enough to be a block of its own.
+BlockHeader* carve_block(BlockHeader* block, unsigned int size) {
+
+	if((block->size - size) >= MINIMUM_BLOCK_SIZE)
+		return split_block(block, size);
+
+	// use full block
+	remove_block(block);
+	mark_used(block);
+	return block;
+}
+
+// Carves an allocation of size bytes off the bottom of heap->top, which must be big enough. Sets
+// *fresh to 1 if its data is all still zero from the kernel.
+BlockHeader* split_top(unsigned int size, int* fresh) {
+
+	BlockHeader* block = heap->top;
+
+	*fresh = (char*)heap->top_clean <= (char*)block_to_data(block);
+
+	if(block->size - size >= MINIMUM_BLOCK_SIZE) {
+		// the rest stays the top block
+		BlockHeader* rest = ptr_add_bytes(block, size + BLOCK_OVERHEAD);
+		init_block(rest, (block->size - size) - BLOCK_OVERHEAD, 0, 1);
+		heap->segment->fence->prev_size = rest->size;
+
+		block->size = size;
+		block->in_use = 1;
+		heap->top = rest;
+		STAT_ADD(STAT_SPLITS, 1);
+
+		if((char*)heap->top_clean < (char*)rest)
+			heap->top_clean = rest;
+	} else {
+		// too small to split, use the whole top, footer and all
+		mark_used(block);
+		heap->top = NULL;
+		*fresh = 0;
+	}
+
+	return block;
+}
+
+// Gives how many bytes to sbrk so that at least needed more bytes are available past heap_end,
+// with the new break landing on a grow_chunk boundary. In huge page mode the heap grows at least
+// a huge page at a time, so it never ends partway into one it could have had whole. It can be
+// more than fits in an unsigned int, which the callers have to check.
+uint64_t chunked_growth(void* heap_end, uint64_t needed)
+{
+	uintptr_t chunk = grow_chunk;
+
+#ifdef MY_MALLOC_HUGEPAGES
+	if(chunk < HUGE_PAGE_SIZE)
+		chunk = HUGE_PAGE_SIZE;
+#endif
+
+	uintptr_t new_end = ((uintptr_t)heap_end + needed + (chunk - 1)) & ~(chunk - 1);
+	return new_end - (uintptr_t)heap_end;
+}
+
+
+// Keeps break_high_water up to date after moving the break up to new_break.
+void note_new_break(void* new_break)
+{
+	if((char*)new_break > (char*)break_high_water)
+		break_high_water = new_break;
+}
+
+// Makes the last segment grow_by bytes longer with new memory right past its end. The old fence
+// becomes part of the top, or the top itself if there wasn't one. Everything from clean_from up
+// is still zero.
+void extend_segment(unsigned int grow_by, void* clean_from) {
+
+	BlockHeader* old_fence = heap->segment->fence;
+
+	if(heap->top != NULL) {
+		heap->top->size += grow_by;
+	} else {
+		heap->top = old_fence;
+		init_block(heap->top, grow_by - BLOCK_OVERHEAD, 0, 1);
+	}
+
+	heap->segment->fence = make_fence(next_phys(heap->top), 0);
+	heap->segment->fence->prev_size = heap->top->size;
+
+	// the old fence is in the middle of the top now, so only the new memory is clean
+	heap->top_clean = clean_from;
+}
+
+// Makes a new segment out of length bytes at memory, which isn't next to the last segment, with
+// all its room in the new top. Everything from clean_from up is still zero.
+void add_segment(void* memory, unsigned int length, void* clean_from) {
+
+	// an old top left behind the gap is just another free block now
+	if(heap->top != NULL) {
+		BlockHeader* old_top = heap->top;
+		heap->top = NULL;
+		insert_into_bin(old_top);
+	}
+
+	Segment* segment = memory;
+	segment->prev = heap->segment;
+	segment->reserved_end = NULL;
+	heap->segment = segment;
+
+	heap->top = segment_first_block(segment);
+	init_block(heap->top, length - SEGMENT_OVERHEAD, 0, 1);
+	segment->fence = make_fence(next_phys(heap->top), 0);
+	segment->fence->prev_size = heap->top->size;
+
+	heap->top_clean = (char*)clean_from > (char*)heap->top ? clean_from : (void*)heap->top;
+}
+
+// Asks the kernel to put the pages of length bytes at memory on a NUMA node, unless node is -1.
+// It's only a preference: if the node is full, they go elsewhere instead of failing.
+void bind_to_node(void* memory, size_t length, int node)
+{
+#ifdef MY_MALLOC_NUMA
+	unsigned long nodes[(MAX_NUMA_NODES + 63) / 64] = {};
+
+	if(node < 0)
+		return;
+
+	nodes[node / 64] |= 1UL << (node % 64);
+
+	// the kernel looks at one bit less than it's told to. If this fails, the memory just isn't
+	// local.
+	syscall(SYS_mbind, memory, length, NUMA_MPOL_PREFERRED, nodes, sizeof(nodes) * 8 + 1, 0);
+#else
+	(void)memory;
+	(void)length;
+	(void)node;
+#endif
+}
+
+// Maps length bytes of address space for a segment to grow into, or gives NULL if it can't. In
+// huge page mode it starts on a huge page boundary and the kernel is asked to back it with huge
+// pages, which only works for whole, aligned ones.
+void* reserve_segment(size_t length) {
+
+	size_t slack = 0;
+
+#ifdef MY_MALLOC_HUGEPAGES
+	// mmap only promises page alignment, so map extra and cut the ends off
+	slack = HUGE_PAGE_SIZE;
+#endif
+
+	char* memory = mmap(NULL, length + slack, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	STAT_ADD(STAT_MMAP_CALLS, 1);
+
+	if(memory == MAP_FAILED)
+		return NULL;
+
+#ifdef MY_MALLOC_HUGEPAGES
+	char* aligned = (char*)(((uintptr_t)memory + (HUGE_PAGE_SIZE - 1)) &
+		~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+	if(aligned != memory)
+		munmap(memory, aligned - memory);
+
+	if(aligned + length != memory + length + slack)
+		munmap(aligned + length, memory + slack - aligned);
+
+	// if the kernel doesn't do huge pages, this fails and the segment gets normal ones
+	madvise(aligned, length, MADV_HUGEPAGE);
+	memory = aligned;
+#endif
+
+	return memory;
+}
+
+// grow_heap for a heap that grows with mmap. Each of its segments is reserved big enough to grow
+// for a long time, so growing is usually just moving the fence up; the kernel only hands out the
+// pages once they're touched.
+int grow_mapped_heap(unsigned int size) {
+
+	Segment* segment = heap->segment;
+
+	if(segment != NULL) {
+		void* heap_end = segment_end(segment);
+		unsigned int needed = heap->top != NULL ? size - heap->top->size : size + BLOCK_OVERHEAD;
+		uint64_t grow_by = chunked_growth(heap_end, (uint64_t)needed + top_pad);
+
+		// the top's size has to stay in an unsigned int, or it gets a segment of its own
+		if(grow_by <= bytes_between_ptrs(heap_end, segment->reserved_end) &&
+			grow_by + (heap->top != NULL ? heap->top->size : 0) <= UINT_MAX) {
+			STAT_ADD(STAT_BYTES_HEAP, grow_by);
+
+			// only up to where release_segment_tail gave pages back may have been used before
+			extend_segment(grow_by, (void*)(((uintptr_t)heap_end + (release_unit() - 1)) &
+				~(uintptr_t)(release_unit() - 1)));
+			return 1;
+		}
+	}
+
+	// out of room, so reserve a new segment
+	uint64_t wanted = (uint64_t)SEGMENT_OVERHEAD + size + top_pad;
+	uint64_t length = (wanted + (release_unit() - 1)) & ~(uint64_t)(release_unit() - 1);
+
+	if(length < MAPPED_SEGMENT_SIZE)
+		length = MAPPED_SEGMENT_SIZE;
+
+	if(length > UINT_MAX)
+		return 0;
+
+	void* memory = reserve_segment(length);
+
+	if(memory == NULL)
+		return 0;
+
+	bind_to_node(memory, length, heap->node);
+
+	uint64_t grow_by = chunked_growth(memory, wanted);
+
+	if(grow_by > length)
+		grow_by = length;
+
+	STAT_ADD(STAT_BYTES_HEAP, grow_by);
+
+	add_segment(memory, grow_by, memory);
+	heap->segment->reserved_end = ptr_add_bytes(memory, length);
+	return 1;
+}
+
+// Grows the heap so that heap->top has at least size bytes. Gives 0 if there's no more memory.
+int grow_heap(unsigned int size) {
+
+	if(heap->mapped)
+		return grow_mapped_heap(size);
+
+	void* heap_end = sbrk(0);
+
+	// Fresh pages are zero, but the rest of the page the break was in may not be unless the
+	// break has only ever gone up to here.
+	void* clean_from = heap_end;
+
+	if(break_high_water != NULL && heap_end != break_high_water)
+		clean_from = (void*)(((uintptr_t)heap_end + (page_size() - 1)) & ~(uintptr_t)(page_size() - 1));
+
+	if(heap->segment != NULL && heap_end == segment_end(heap->segment)) {
+		// the segment is still at the break, so just extend it
+		unsigned int needed = heap->top != NULL ? size - heap->top->size : size + BLOCK_OVERHEAD;
+		uint64_t grow_by = chunked_growth(heap_end, (uint64_t)needed + top_pad);
+
+		// the top's size has to stay in an unsigned int
+		if(grow_by + (heap->top != NULL ? heap->top->size : 0) > UINT_MAX)
+			return 0;
+
+		STAT_ADD(STAT_SBRK_CALLS, 1);
+
+		if(sbrk(grow_by) == (void*)-1)
+			return 0;
+
+		STAT_ADD(STAT_BYTES_HEAP, grow_by);
+
+		note_new_break(ptr_add_bytes(heap_end, grow_by));
+		extend_segment(grow_by, clean_from);
+		return 1;
+	}
+
+	// Either this is the first growth, or something else moved the break since we last grew.
+	// Either way the new memory isn't next to any segment, so it gets one of its own.
+
+	// somebody else's break may not be aligned for us
+	unsigned int misalignment = (unsigned int)(-(uintptr_t)heap_end & (SIZE_MULTIPLE - 1));
+
+	uint64_t grow_by = chunked_growth(heap_end,
+		(uint64_t)misalignment + SEGMENT_OVERHEAD + size + top_pad);
+
+	if(grow_by > UINT_MAX)
+		return 0;
+
+	void* new_memory = sbrk(grow_by);
+	STAT_ADD(STAT_SBRK_CALLS, 1);
+
+	if(new_memory == (void*)-1)
+		return 0;
+
+	STAT_ADD(STAT_BYTES_HEAP, grow_by);
+
+	note_new_break(ptr_add_bytes(new_memory, grow_by));
+	add_segment(ptr_add_bytes(new_memory, misalignment), grow_by - misalignment, clean_from);
+	return 1;
+}
+
+// Gives back the memory between the end of the last segment and old_end, where it ended before
+// it was just shrunk.
+void release_segment_tail(void* old_end) {
+
+	void* new_end = segment_end(heap->segment);
+
+	STAT_ADD(STAT_BYTES_HEAP, -(long long)bytes_between_ptrs(new_end, old_end));
+
+	if(!heap->mapped) {
+		STAT_ADD(STAT_BRK_CALLS, 1);
+		brk(new_end);
+		return;
+	}
+
+	// the segment keeps its reservation, but the pages past its end don't need to stay around
+	uintptr_t unit_mask = ~(uintptr_t)(release_unit() - 1);
+	uintptr_t from = ((uintptr_t)new_end + (release_unit() - 1)) & unit_mask;
+	uintptr_t to = ((uintptr_t)old_end + (release_unit() - 1)) & unit_mask;
+
+	if(from < to)
+		madvise((void*)from, to - from, MADV_DONTNEED);
+}
+
+// Gives the last segment back to the kernel once it's empty, having shrunk from old_end. The one
+// before it is the last one again.
+void release_last_segment(void* old_end) {
+
+	Segment* empty = heap->segment;
+
+	heap->segment = empty->prev;
+
+	// its last block was binned when we moved past it, but it's the top again now
+	if(heap->segment != NULL && !heap->segment->fence->prev_in_use) {
+		heap->top = prev_phys(heap->segment->fence);
+		remove_block(heap->top);
+		heap->top_clean = block_end(heap->top);
+	}
+
+	STAT_ADD(STAT_BYTES_HEAP, -(long long)bytes_between_ptrs(empty, old_end));
+	(void)old_end; // only the stats need it
+
+	if(heap->mapped) {
+		STAT_ADD(STAT_MUNMAP_CALLS, 1);
+		munmap(empty, bytes_between_ptrs(empty, empty->reserved_end));
+	} else {
+		STAT_ADD(STAT_BRK_CALLS, 1);
+		brk(empty);
+	}
+}
+
+// Gives the free top of the heap back to the kernel, keeping pad bytes of it. Does nothing if
+// something else owns the memory past the top. Gives 1 if any memory was released.
+int trim_top(unsigned int pad) {
+
+	if(heap->top == NULL || (!heap->mapped && sbrk(0) != segment_end(heap->segment)))
+		return 0;
+
+	pad = round_up_size(pad);
+
+	if(pad != 0 && pad + BLOCK_OVERHEAD >= heap->top->size)
+		return 0;
+
+	void* old_end = segment_end(heap->segment);
+
+	if(pad == 0) {
+		// release the whole block. Its header becomes the new fence.
+		heap->segment->fence = make_fence(heap->top, 1);
+		heap->top = NULL;
+	} else {
+		heap->top->size = pad;
+		heap->segment->fence = make_fence(next_phys(heap->top), 0);
+		heap->segment->fence->prev_size = pad;
+
+		if((char*)heap->top_clean > (char*)heap->segment->fence)
+			heap->top_clean = heap->segment->fence;
+	}
+
+	if(heap->segment->fence != segment_first_block(heap->segment))
+		release_segment_tail(old_end);
+	else
+		release_last_segment(old_end); // that emptied the segment, so release all of it
+
+	return 1;
+}
+
+// Gives back the whole pages inside a free block, which stays binned. Gives how many bytes that
+// was.
+unsigned int purge_block(BlockHeader* block) {
+
+	unsigned int bytes = purgeable_bytes(block);
+	uintptr_t unit = release_unit();
+	uintptr_t from = ((uintptr_t)block + sizeof(OverflowNode) + (unit - 1)) & ~(unit - 1);
+
+	if(bytes == 0)
+		return 0;
+
+	madvise((void*)from, bytes, PURGE_ADVICE);
+	STAT_ADD(STAT_PURGED_BYTES, bytes);
+
+	block->purged = 1;
+	heap->dirty_bytes -= bytes;
+	return bytes;
+}
+
+// Purges block if it's dirty and either all is set or it has lived through a purge already;
+// otherwise a dirty block is marked aged, so the next purge takes it if it's still free then.
+// Gives how many bytes it gave back.
+unsigned int purge_or_age(BlockHeader* block, int all) {
+
+	if(block->purged)
+		return 0;
+
+	if(all || block->aged)
+		return purge_block(block);
+
+	block->aged = 1;
+	return 0;
+}
+
+// purge_or_age for every block in the overflow tree under node.
+unsigned long long purge_tree(BlockHeader* node, int all) {
+
+	if(node == NULL)
+		return 0;
+
+	return purge_tree(node->prev_free, all) + purge_or_age(node, all) +
+		purge_tree(node->next_free, all);
+}
+
+// Gives back the pages of the binned blocks that have been free since the last purge without
+// being used, or of every binned block if all is set, so a block that's reused soon after it's
+// freed doesn't have to fault its pages back in. Gives how many bytes it gave back.
+unsigned long long purge_heap(int all) {
+
+	unsigned long long purged = 0;
+	unsigned int bin_index = find_nonempty_bin(size_to_bin(release_unit()));
+	BlockHeader* block;
+
+	for(; bin_index < OVERFLOW_BIN; bin_index = find_nonempty_bin(bin_index + 1)) {
+		for(block = heap->bins[bin_index]; block != NULL; block = block->next_free)
+			purged += purge_or_age(block, all);
+	}
+
+	if(bin_index == OVERFLOW_BIN)
+		purged += purge_tree(heap->bins[OVERFLOW_BIN], all);
+
+	heap->dirty_low = heap->dirty_bytes;
+	return purged;
+}
+
+// Makes an empty heap that grows with mmap, bound to a NUMA node unless node is -1, and puts it
+// in heaps[]. Gives NULL if there's no memory or no room in heaps[]. The caller must hold the
+// heap list lock.
+Heap* make_heap(int node)
+{
+	unsigned int index;
+
+	for(index = 1; index < MAX_HEAPS && heaps[index] != NULL; index++)
+		;
+
+	if(index == MAX_HEAPS)
+		return NULL;
+
+	// it's all zero from the kernel, so it starts out with every bin empty
+	Heap* made = mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0);
+	STAT_ADD(STAT_MMAP_CALLS, 1);
+
+	if(made == MAP_FAILED)
+		return NULL;
+
+	bind_to_node(made, sizeof(Heap), node);
+
+#ifdef MY_MALLOC_THREADS
+	pthread_mutex_init(&made->lock, NULL);
+#endif
+
+	made->index = index;
+	made->mapped = 1;
+	made->node = node;
+	heaps[index] = made;
+	return made;
+}
+
+// Takes the heap list lock and then every heap's lock, for changes that affect every heap.
+void lock_all_heaps()
+{
+#ifdef MY_MALLOC_THREADS
+	unsigned int index;
+
+	LOCK_HEAP_LIST();
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] != NULL)
+			pthread_mutex_lock(&heaps[index]->lock);
+	}
+#endif
+}
+
+void unlock_all_heaps()
+{
+#ifdef MY_MALLOC_THREADS
+	unsigned int index;
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] != NULL)
+			pthread_mutex_unlock(&heaps[index]->lock);
+	}
+
+	UNLOCK_HEAP_LIST();
+#endif
+}
+
+// =================================================================================================
+// mmap'd blocks
+// =================================================================================================
+
+// Maps a block of its own for size bytes. It never goes in bins[] or in a segment, so it
+// doesn't need the heap lock. Gives NULL if mmap fails.
+BlockHeader* allocate_mmapped_block(unsigned int size)
+{
+	unsigned int length = round_up_to_pages(size + BLOCK_HEADER_SIZE);
+
+	// the size would have overflowed
+	if(length < size)
+		return NULL;
+
+	BlockHeader* block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0);
+	STAT_ADD(STAT_MMAP_CALLS, 1);
+
+	if(block == MAP_FAILED)
+		return NULL;
+
+	STAT_ADD(STAT_BYTES_MMAPPED, length);
+	bind_to_node(block, length, heap->node);
+
+	// whatever the page rounding added is usable too
+	init_block(block, length - BLOCK_HEADER_SIZE, 1, 1);
+	block->mmapped = 1;
+	return block;
+}
+
+void free_mmapped_block(BlockHeader* block)
+{
+	STAT_ADD(STAT_MUNMAP_CALLS, 1);
+	STAT_ADD(STAT_BYTES_MMAPPED, -(long long)(block->size + BLOCK_HEADER_SIZE));
+	munmap(block, block->size + BLOCK_HEADER_SIZE);
+}
+
+#ifdef MY_MALLOC_SLABS
+
+// =================================================================================================
+// Slabs
+// =================================================================================================
+
+// Gives 1 if ptr points into the slab region.
+int is_slab_pointer(void* ptr)
+{
+	return slab_region != NULL && (char*)ptr >= slab_region &&
+		(char*)ptr < slab_region + SLAB_REGION_SIZE;
+}
+
+// Gives the slab page a slab pointer is in.
+SlabPage* slab_page_of(void* ptr)
+{
+	return (SlabPage*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+// Gives the address of the first object in a page.
+char* slab_objects(SlabPage* page)
+{
+	return ptr_add_bytes(page, (sizeof(SlabPage) + (SIZE_MULTIPLE - 1)) & ~(SIZE_MULTIPLE - 1));
+}
+
+// Reserves the slab region, aligned to SLAB_PAGE_SIZE. Gives 0 if mmap fails.
+int reserve_slab_region()
+{
+	// reserve an extra page's worth so there's room to align it
+	char* reserved = mmap(NULL, SLAB_REGION_SIZE + SLAB_PAGE_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	STAT_ADD(STAT_MMAP_CALLS, 1);
+
+	if(reserved == MAP_FAILED)
+		return 0;
+
+	char* aligned = (char*)(((uintptr_t)reserved + (SLAB_PAGE_SIZE - 1)) &
+		~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+
+	// give back the unaligned ends
+	if(aligned != reserved)
+		munmap(reserved, aligned - reserved);
+
+	munmap(aligned + SLAB_REGION_SIZE, (reserved + SLAB_PAGE_SIZE) - aligned);
+
+	slab_region = aligned;
+	return 1;
+}
+
+void push_slab_partial(SlabPage* page)
+{
+	page->prev_partial = NULL;
+	page->next_partial = slab_partial[page->bin_index];
+
+	if(page->next_partial != NULL)
+		page->next_partial->prev_partial = page;
+
+	slab_partial[page->bin_index] = page;
+}
+
+void remove_slab_partial(SlabPage* page)
+{
+	if(page->prev_partial != NULL)
+		page->prev_partial->next_partial = page->next_partial;
+	else
+		slab_partial[page->bin_index] = page->next_partial;
+
+	if(page->next_partial != NULL)
+		page->next_partial->prev_partial = page->prev_partial;
+}
+
+// Gets a page for a bin's objects, reusing an empty page if there is one, and puts it on the bin's
+// partial list. Gives NULL if the slab region is used up. The caller must hold the slab lock.
+SlabPage* make_slab_page(unsigned int bin_index)
+{
+	SlabPage* page = slab_free_pages;
+
+	if(page != NULL) {
+		slab_free_pages = page->next_partial;
+	} else {
+		if(slab_region == NULL && !reserve_slab_region())
+			return NULL;
+
+		if(slab_region_used == SLAB_REGION_SIZE)
+			return NULL;
+
+		page = (SlabPage*)(slab_region + slab_region_used);
+
+		if(mprotect(page, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE) != 0)
+			return NULL;
+
+		slab_region_used += SLAB_PAGE_SIZE;
+	}
+
+	STAT_ADD(STAT_BYTES_MMAPPED, SLAB_PAGE_SIZE);
+
+	// objects are only SIZE_MULTIPLE apart (and so aligned to it) if their size is a multiple of it
+	unsigned int object_size = (bin_min_size(bin_index) + (SIZE_MULTIPLE - 1)) &
+		~(SIZE_MULTIPLE - 1);
+	unsigned int capacity = bytes_between_ptrs(slab_objects(page), ptr_add_bytes(page,
+		SLAB_PAGE_SIZE)) / object_size;
+	unsigned int word;
+
+	page->bin_index = bin_index;
+	page->object_size = object_size;
+	page->capacity = capacity;
+	page->free_count = capacity;
+	page->untouched = 0;
+	page->search_from = 0;
+
+	for(word = 0; word < SLAB_BITMAP_WORDS; word++) {
+		if(capacity >= (word + 1) * BITMAP_WORD_BITS)
+			page->free_bitmap[word] = ~(uint64_t)0;
+		else if(capacity > word * BITMAP_WORD_BITS)
+			page->free_bitmap[word] = ((uint64_t)1 << (capacity - word * BITMAP_WORD_BITS)) - 1;
+		else
+			page->free_bitmap[word] = 0;
+	}
+
+	push_slab_partial(page);
+	return page;
+}
+
+// Allocates an object from a small bin's slab pages. Sets *fresh to 1 if it's never been used.
+// Gives NULL if there's no room for another page. The caller must hold the slab lock.
+void* slab_alloc(unsigned int bin_index, int* fresh)
+{
+	SlabPage* page = slab_partial[bin_index];
+
+	if(page == NULL) {
+		page = make_slab_page(bin_index);
+
+		if(page == NULL)
+			return NULL;
+	}
+
+	// the lowest free object keeps used objects packed at the start of the page
+	unsigned int word = page->search_from;
+
+	while(page->free_bitmap[word] == 0)
+		word++;
+
+	unsigned int index = word * BITMAP_WORD_BITS + __builtin_ctzll(page->free_bitmap[word]);
+
+	page->free_bitmap[word] &= page->free_bitmap[word] - 1;
+	page->search_from = word;
+
+	if(index >= page->untouched) {
+		*fresh = 1;
+		page->untouched = index + 1;
+	}
+
+	if(--page->free_count == 0)
+		remove_slab_partial(page);
+
+	return slab_objects(page) + index * page->object_size;
+}
+
+// Gives a slab object back to its page. A page that empties out while its bin has other pages
+// with free objects is given back to the kernel. The caller must hold the slab lock.
+void slab_free(void* ptr)
+{
+	SlabPage* page = slab_page_of(ptr);
+	unsigned int index = bytes_between_ptrs(slab_objects(page), ptr) / page->object_size;
+	unsigned int word = index / BITMAP_WORD_BITS;
+
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+	if(page->free_bitmap[word] & ((uint64_t)1 << (index % BITMAP_WORD_BITS)))
+		heap_corrupted("double free of a slab object");
+#endif
+
+	assert(!(page->free_bitmap[word] & ((uint64_t)1 << (index % BITMAP_WORD_BITS))));
+
+	page->free_bitmap[word] |= (uint64_t)1 << (index % BITMAP_WORD_BITS);
+
+	if(word < page->search_from)
+		page->search_from = word;
+
+	if(page->free_count++ == 0)
+		push_slab_partial(page);
+
+	// the last page of a bin stays around so alloc/free churn doesn't map and unmap it
+	if(page->free_count == page->capacity &&
+		(page->prev_partial != NULL || page->next_partial != NULL)) {
+		remove_slab_partial(page);
+		madvise(page, SLAB_PAGE_SIZE, MADV_DONTNEED);
+		STAT_ADD(STAT_BYTES_MMAPPED, -SLAB_PAGE_SIZE);
+
+		page->next_partial = slab_free_pages;
+		slab_free_pages = page;
+	}
+}
+
+#endif
+
+// Gives how many bytes can be used at ptr, which has to be allocated.
+unsigned int usable_size(void* ptr)
+{
+#ifdef MY_MALLOC_SLABS
+	if(is_slab_pointer(ptr))
+		return slab_page_of(ptr)->object_size;
+#endif
+
+	return data_to_block(ptr)->size;
+}
+
+// =================================================================================================
+// Heap internals
+// =================================================================================================
+
+// Gives a used block back to the heap, coalescing it and contracting the heap if it ends up at
+// the top and the top is over trim_threshold. The caller must hold the heap lock.
+void free_block(BlockHeader* block_to_free)
+{
+	BlockHeader* old_top = heap->top;
+
+	block_to_free = coalesce(block_to_free);
+	mark_free(block_to_free);
+
+	if(next_phys(block_to_free) == heap->segment->fence) {
+		// it's the last block, so it becomes the top. Only shrink the heap once the top gets big, so
+		// alloc/free churn at the tail doesn't turn into sbrk/brk churn.
+		heap->top = block_to_free;
+
+		// if there was a top, we just merged into it and its clean part is still clean
+		if(old_top == NULL)
+			heap->top_clean = block_end(heap->top);
+
+		if(heap->top->size > trim_threshold)
+			trim_top(top_pad);
+	} else {
+		insert_into_bin(block_to_free);
+
+		// only purge again once enough has been dirtied since the last time
+		if(purge_threshold != 0 && heap->dirty_bytes > heap->dirty_low + purge_threshold)
+			purge_heap(0);
+	}
+}
+
+// Frees every block waiting in the fast bins for real, coalescing them. The caller must hold the
+// heap lock.
+void consolidate_fast_bins()
+{
+	unsigned int bin_index;
+
+	for(bin_index = 0; bin_index < NUM_SMALL_BINS && heap->fast_block_count != 0; bin_index++) {
+		BlockHeader* block = heap->fast_bins[bin_index];
+
+		while(block != NULL) {
+			BlockHeader* next = list_next(block);
+			free_block(block);
+			block = next;
+		}
+
+		heap->fast_block_count -= heap->fast_counts[bin_index];
+		heap->fast_bins[bin_index] = NULL;
+		heap->fast_counts[bin_index] = 0;
+	}
+}
+
+// Carves size bytes out of a block in a geometric bin's list, if one fits: the first one that
+// does, or the smallest in best fit mode. Gives NULL if none fits.
+BlockHeader* search_bin(unsigned int bin_index, unsigned int size)
+{
+	BlockHeader* current;
+	BlockHeader* found = NULL;
+
+	STAT_ADD(STAT_OVERFLOW_SEARCHES, 1);
+
+	for(current = heap->bins[bin_index]; current != NULL; current = current->next_free) {
+		STAT_ADD(STAT_OVERFLOW_STEPS, 1);
+
+		if(current->size < size || (found != NULL && current->size >= found->size))
+			continue;
+
+		found = current;
+
+		// nothing fits better than exactly
+		if(!BEST_FIT || found->size == size)
+			break;
+	}
+
+	return found != NULL ? carve_block(found, size) : NULL;
+}
+
+// Finds or makes a block for size bytes, which must already be rounded up with round_up_size.
+// Sets *fresh to 1 if the block's data is known to be all zero. The caller must hold the heap lock.
+BlockHeader* allocate_block(unsigned int size, int* fresh)
+{
+	*fresh = 0;
+
+	unsigned int bin_index = size_to_bin(size);
+
+	BlockHeader* current = heap->bins[bin_index];
+	BlockHeader* new_allocation = NULL;
+
+	if(bin_index < NUM_SMALL_BINS && heap->fast_bins[bin_index] != NULL) {
+		// a fast block is still marked in use, so it just comes off the stack
+		new_allocation = heap->fast_bins[bin_index];
+		heap->fast_bins[bin_index] = list_next(new_allocation);
+		heap->fast_counts[bin_index]--;
+		heap->fast_block_count--;
+
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+		new_allocation->prev_free = NULL;
+#endif
+		return new_allocation;
+	}
+
+	if(bin_index < NUM_SMALL_BINS && current != NULL) {
+		// remove block from a small bin
+		new_allocation = current;
+		remove_block(current);
+		mark_used(new_allocation);
+	} else if(bin_index < OVERFLOW_BIN) {
+		// Find the first non-empty bin whose blocks are all big enough. For a small size, only
+		// take blocks big enough to split, so the leftovers can be reused; for a geometric size,
+		// anything that fits is a good fit. Either way it's the head block, so there's no search.
+		unsigned int index = find_nonempty_bin(bin_index < NUM_SMALL_BINS ?
+			size_to_fit_bin(size + MINIMUM_BLOCK_SIZE) : size_to_fit_bin(size));
+
+		// whatever fits in this size's own geometric bin is smaller than any block in the bins above
+		if(BEST_FIT && bin_index >= NUM_SMALL_BINS)
+			new_allocation = search_bin(bin_index, size);
+
+		if(new_allocation == NULL && index < OVERFLOW_BIN)
+			new_allocation = carve_block(heap->bins[index], size);
+
+		// nothing bigger, but this size's own geometric bin may still have a block that fits
+		if(!BEST_FIT && new_allocation == NULL && bin_index >= NUM_SMALL_BINS)
+			new_allocation = search_bin(bin_index, size);
+	}
+
+	if(new_allocation == NULL) {
+		// best fit
+		current = tree_best_fit(size);
+
+		if(current != NULL)
+			new_allocation = carve_block(current, size);
+	}
+
+	// before touching the top, see if merging the deferred frees makes something fit
+	if(new_allocation == NULL && heap->fast_block_count != 0) {
+		consolidate_fast_bins();
+		return allocate_block(size, fresh);
+	}
+
+	// no free block fits, so carve it from the top, growing the heap if needed
+	if(new_allocation == NULL) {
+		// Grow early enough that the split leaves a usable top, rather than handing out the whole
+		// top as an oversized block that won't fit back in this size's bin. Only settle for that
+		// if the heap can't grow.
+		if(heap->top == NULL || heap->top->size < size + MINIMUM_BLOCK_SIZE) {
+			if(!grow_heap(size + MINIMUM_BLOCK_SIZE) &&
+				(heap->top == NULL || heap->top->size < size))
+				return NULL;
+		}
+
+		new_allocation = split_top(size, fresh);
+	}
+
+	return new_allocation;
+}
+
+// Frees a used block for my_free: into its fast bin if deferred coalescing is on and there's room,
+// otherwise right away. The caller must hold the heap lock.
+void release_block(BlockHeader* block)
+{
+	unsigned int bin_index = size_to_bin(block->size);
+
+	if(block->size <= fast_max && bin_index < NUM_SMALL_BINS &&
+		heap->fast_counts[bin_index] < FAST_BIN_LIMIT) {
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+		if(block->prev_free == cached_key())
+			check_not_on_list(block, heap->fast_bins[bin_index]);
+
+		block->prev_free = cached_key();
+#endif
+
+		set_list_next(block, heap->fast_bins[bin_index]);
+		heap->fast_bins[bin_index] = block;
+		heap->fast_counts[bin_index]++;
+		heap->fast_block_count++;
+		return;
+	}
+
+	free_block(block);
+}
+
+// Shrinks a used heap block to size bytes, giving the tail back to the heap if it's big enough to
+// be a block of its own. The caller must hold the heap lock.
+void shrink_block(BlockHeader* block, unsigned int size)
+{
+	if(block->size - size < MINIMUM_BLOCK_SIZE)
+		return;
+
+	// split the tail off as a used block, then free it so it coalesces with whatever follows
+	BlockHeader* rest = ptr_add_bytes(block, size + BLOCK_OVERHEAD);
+	init_block(rest, (block->size - size) - BLOCK_OVERHEAD, 1, 1);
+
+	block->size = size;
+	free_block(rest);
+}
+
+// Tries to grow a used heap block to size bytes without moving it, by absorbing its free physical
+// neighbor, extending the heap first if the block is at the top. Gives 1 if it worked. The caller
+// must hold the heap lock.
+int grow_block_in_place(BlockHeader* block, unsigned int size)
+{
+	BlockHeader* next = next_phys(block);
+
+	if((next == heap->segment->fence) ||
+		(next == heap->top && block->size + BLOCK_OVERHEAD + next->size < size)) {
+		// for the default heap, only possible if nothing else has moved the break past us
+		if(!heap->mapped && sbrk(0) != segment_end(heap->segment))
+			return 0;
+
+		unsigned int gap = size - block->size;
+		unsigned int top_needed = gap > MINIMUM_BLOCK_SIZE ? gap - BLOCK_OVERHEAD : MINIMUM_ALLOCATION;
+
+		if(!grow_heap(top_needed))
+			return 0;
+
+		next = next_phys(block);
+	}
+
+	if(next->in_use || block->size + BLOCK_OVERHEAD + next->size < size) {
+		// the neighbors might only look used because they're waiting in fast bins
+		if(heap->fast_block_count != 0) {
+			consolidate_fast_bins();
+			return grow_block_in_place(block, size);
+		}
+
+		return 0;
+	}
+
+	take_free_block(next);
+
+	block->size += BLOCK_OVERHEAD + next->size;
+	next_phys(block)->prev_in_use = 1;
+
+	// give back whatever we absorbed past size
+	shrink_block(block, size);
+	return 1;
+}
+
+// Allocates a block for size bytes whose data is a multiple of alignment (a power of two) bytes.
+// It over-allocates, then frees the slack before and after the aligned part so it can be reused.
+// Gives NULL if there's no memory. The caller must hold the heap lock.
+BlockHeader* allocate_aligned_block(unsigned int alignment, unsigned int size)
+{
+	int fresh;
+	size = round_up_size(size);
+
+	// enough for the aligned data plus a whole free block in front of it
+	unsigned int padded = size + alignment + MINIMUM_BLOCK_SIZE;
+
+	if(padded < size || padded > MAX_ALLOCATION)
+		return NULL;
+
+	BlockHeader* block = allocate_block(round_up_size(padded), &fresh);
+
+	if(block == NULL)
+		return NULL;
+
+	void* data = block_to_data(block);
+
+	if(((uintptr_t)data & (alignment - 1)) != 0) {
+		// the slack in front has to be big enough to be a block of its own
+		uintptr_t aligned = ((uintptr_t)data + MINIMUM_BLOCK_SIZE + (alignment - 1)) &
+			~(uintptr_t)(alignment - 1);
+		unsigned int gap = (unsigned int)(aligned - (uintptr_t)data);
+
+		BlockHeader* aligned_block = data_to_block((void*)aligned);
+		init_block(aligned_block, block->size - gap, 1, 1);
+
+		block->size = gap - BLOCK_OVERHEAD;
+		free_block(block);
+		block = aligned_block;
+	}
+
+	// and give back whatever's left past the end
+	shrink_block(block, size);
+	return block;
+}
+
+// Takes up to n blocks from the head of a small bin in one splice, puts their data pointers in
+// out, and gives how many it took. The caller must hold the heap lock.
+unsigned int take_bin_run(unsigned int bin_index, unsigned int n, void** out)
+{
+	BlockHeader* block = heap->bins[bin_index];
+	unsigned int count = 0;
+
+	while(block != NULL && count < n) {
+		BlockHeader* next = block->next_free;
+		mark_used(block);
+		out[count++] = block_to_data(block);
+		block = next;
+	}
+
+	heap->bins[bin_index] = block;
+
+	if(block == NULL)
+		mark_bin_empty(bin_index);
+	else
+		block->prev_free = NULL;
+
+	BIN_STAT_ADD(bin_index, -(long long)count);
+	return count;
+}
+
+// Carves n blocks of size bytes, one after another, off the top, growing the heap once for all of
+// them. Gives n, or 0 if the heap couldn't grow enough. The caller must hold the heap lock.
+unsigned int carve_top_run(unsigned int size, unsigned int n, void** out)
+{
+	int fresh;
+	unsigned int i;
+
+	if(n == 0)
+		return 0;
+
+	// leave enough behind for the last split to leave a usable top
+	uint64_t needed = (uint64_t)n * (size + BLOCK_OVERHEAD) + MINIMUM_ALLOCATION;
+
+	if(needed > UINT_MAX)
+		return 0;
+
+	if(heap->top == NULL || heap->top->size < needed) {
+		if(!grow_heap(needed))
+			return 0;
+	}
+
+	for(i = 0; i < n; i++)
+		out[i] = block_to_data(split_top(size, &fresh));
+
+	return n;
+}
+
+#ifdef MY_MALLOC_THREADS
+
+// Frees a NULL-terminated list of blocks linked through next_free into bins[].
+// The caller must hold the heap lock.
+void free_block_list(BlockHeader* block)
+{
+	while(block != NULL) {
+		BlockHeader* next = list_next(block);
+		free_block(block);
+		block = next;
+	}
+}
+
+// Pushes a block onto the calling thread's cache for its bin.
+void push_thread_cache(BlockHeader* block, unsigned int bin_index)
+{
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+	if(block->prev_free == cached_key())
+		check_not_on_list(block, thread_cache.blocks[bin_index]);
+
+	block->prev_free = cached_key();
+#endif
+
+	set_list_next(block, thread_cache.blocks[bin_index]);
+	thread_cache.blocks[bin_index] = block;
+	thread_cache.counts[bin_index]++;
+}
+
+// Pushes a small block onto its owner's remote free list. Safe to call from any thread.
+void push_remote_free(BlockHeader* block)
+{
+	RemoteFreeList* list = &remote_frees[block->owner];
+	BlockHeader* head = atomic_load_explicit(&list->head, memory_order_relaxed);
+
+	do {
+		set_list_next(block, head);
+	} while(!atomic_compare_exchange_weak_explicit(&list->head, &head, block,
+		memory_order_release, memory_order_relaxed));
+}
+
+// Takes back every block other threads freed on our behalf and puts them in our cache. Blocks
+// that don't fit under THREAD_CACHE_LIMIT are linked onto *release for the caller to free.
+void drain_remote_frees(BlockHeader** release)
+{
+	BlockHeader* block = atomic_exchange_explicit(&remote_frees[thread_cache.id].head, NULL,
+		memory_order_acquire);
+
+	while(block != NULL) {
+		BlockHeader* next = list_next(block);
+		unsigned int bin_index = size_to_bin(block->size);
+
+		if(thread_cache.counts[bin_index] < THREAD_CACHE_LIMIT) {
+			push_thread_cache(block, bin_index);
+		} else {
+			set_list_next(block, *release);
+			*release = block;
+		}
+
+		block = next;
+	}
+}
+
+// Gives every block in the calling thread's cache, and any waiting on its remote free list, back
+// to bins[]. The calling thread's heap (see local_heap) must be the current one, and locked.
+void flush_thread_cache()
+{
+	BlockHeader* release = NULL;
+	unsigned int bin_index;
+
+	if(thread_cache.id != 0)
+		drain_remote_frees(&release);
+
+	free_block_list(release);
+
+	for(bin_index = 0; bin_index < NUM_SMALL_BINS; bin_index++) {
+		free_block_list(thread_cache.blocks[bin_index]);
+		thread_cache.blocks[bin_index] = NULL;
+		thread_cache.counts[bin_index] = 0;
+	}
+}
+
+// Runs when a thread exits: flushes its cache and gives up its remote free list so another thread
+// can claim it.
+void release_thread_cache(void* unused)
+{
+	(void)unused;
+
+	// other destructors can still allocate and free, but nothing would flush the cache again
+	thread_cache.shutting_down = 1;
+
+	heap = local_heap();
+	LOCK_HEAP();
+	flush_thread_cache();
+	UNLOCK_HEAP();
+
+	heap = &default_heap;
+	LOCK_HEAP();
+
+#ifndef MY_MALLOC_NO_STATS
+	unsigned int stat;
+
+	for(stat = 0; stat < NUM_STATS; stat++)
+		exited_thread_stats[stat] += thread_stats.counters[stat];
+
+	live_thread_stats[thread_cache.id] = NULL;
+#endif
+
+	// Anything pushed after the flush above stays on the list until the next thread to claim
+	// this slot drains it.
+	remote_frees[thread_cache.id].claimed = 0;
+	thread_cache.id = 0;
+	UNLOCK_HEAP();
+}
+
+void make_thread_cache_key()
+{
+	pthread_key_create(&thread_cache_key, release_thread_cache);
+
+	// Every heap is held across fork, so the child's copy isn't caught halfway through a change.
+	// Only the forking thread lives on in the child; whatever the other threads had cached is
+	// just lost.
+	pthread_atfork(lock_all_heaps, unlock_all_heaps, unlock_all_heaps);
+}
+
+#ifdef MY_MALLOC_NUMA
+
+// Gives the NUMA node the calling thread is running on, or -1 if the kernel won't say.
+int current_node()
+{
+	unsigned int cpu, node;
+
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return -1;
+
+	return node;
+}
+
+// Gives a NUMA node's heap, making it the first time a thread on that node asks. Gives NULL if
+// the node is past MAX_NUMA_NODES or its heap can't be made.
+Heap* node_heap(int node)
+{
+	if(node < 0 || node >= MAX_NUMA_NODES)
+		return NULL;
+
+	LOCK_HEAP_LIST();
+
+	if(node_heaps[node] == NULL)
+		node_heaps[node] = make_heap(node);
+
+	Heap* found = node_heaps[node];
+	UNLOCK_HEAP_LIST();
+	return found;
+}
+
+#endif
+
+// Arranges for the calling thread's cache to be flushed when the thread exits, and claims a
+// remote free list so other threads can give our blocks back.
+void register_thread_cache()
+{
+	unsigned int id;
+
+	pthread_once(&thread_cache_key_once, make_thread_cache_key);
+
+#ifdef MY_MALLOC_NUMA
+	// Threads can move between nodes, but most stay where they started. If there's no heap for
+	// this node, the thread uses the default heap.
+	thread_cache.home = node_heap(current_node());
+#endif
+
+	// The value only has to be non-NULL for the destructor to run. Setting it can allocate, so
+	// mark this thread registered first, or that allocation would register it again.
+	thread_cache.registered = 1;
+	pthread_setspecific(thread_cache_key, &thread_cache);
+
+	heap = &default_heap;
+	LOCK_HEAP();
+
+	for(id = 1; id < MAX_THREAD_CACHES; id++) {
+		if(!remote_frees[id].claimed &&
+			(remote_frees[id].home == NULL || remote_frees[id].home == local_heap())) {
+			remote_frees[id].claimed = 1;
+			remote_frees[id].home = local_heap();
+			thread_cache.id = id;
+#ifndef MY_MALLOC_NO_STATS
+			live_thread_stats[id] = &thread_stats;
+#endif
+			break;
+		}
+	}
+
+	UNLOCK_HEAP();
+}
+
+#endif
+
+// What my_malloc and my_calloc share. Sets *fresh to 1 if the memory is known to be all zero,
+// straight from sbrk or mmap.
+void* allocate(unsigned int size, int* fresh)
+{
+	*fresh = 0;
+
+	if(size == 0 || size > MAX_ALLOCATION)
+		return NULL;
+
+	size = round_up_size(size);
+
+	// only the sizes the table covers are worth sampling
+	if(sampling_sizes && size > BIGGEST_BINNED_SIZE && size < CLASS_TABLE_SIZE &&
+		++sample_countdown >= SIZE_SAMPLE_PERIOD) {
+		sample_countdown = 0;
+		size_samples[size / SIZE_MULTIPLE]++;
+	}
+
+#ifdef MY_MALLOC_THREADS
+	// also makes this thread's stats visible to my_malloc_stats
+	if(!thread_cache.registered)
+		register_thread_cache();
+#endif
+
+	heap = local_heap();
+
+	// huge allocations skip the heap (and its lock) entirely, unless mmap fails
+	if(size >= mmap_threshold) {
+		BlockHeader* mapped = allocate_mmapped_block(size);
+
+		if(mapped != NULL) {
+			*fresh = 1;
+			RECORD_MALLOC(block_to_data(mapped));
+			return block_to_data(mapped);
+		}
+	}
+
+#ifdef MY_MALLOC_SLABS
+	// small allocations come from slabs, falling back to the heap if the slab region is full
+	if(size_to_bin(size) < NUM_SMALL_BINS) {
+		LOCK_SLABS();
+		void* object = slab_alloc(size_to_bin(size), fresh);
+		UNLOCK_SLABS();
+
+		if(object != NULL) {
+			RECORD_MALLOC(object);
+			return object;
+		}
+	}
+#endif
+
+#ifdef MY_MALLOC_THREADS
+	unsigned int bin_index = size_to_bin(size);
+
+	if(bin_index < NUM_SMALL_BINS && !thread_cache.shutting_down) {
+		BlockHeader* cached = thread_cache.blocks[bin_index];
+
+		if(cached == NULL) {
+			// see if other threads have given any of our blocks back
+			if(thread_cache.id != 0 && atomic_load_explicit(&remote_frees[thread_cache.id].head,
+				memory_order_relaxed) != NULL) {
+				BlockHeader* release = NULL;
+				drain_remote_frees(&release);
+
+				if(release != NULL) {
+					LOCK_HEAP();
+					free_block_list(release);
+					UNLOCK_HEAP();
+				}
+
+				cached = thread_cache.blocks[bin_index];
+			}
+		}
+
+		// hit: no lock needed
+		if(cached != NULL) {
+			thread_cache.blocks[bin_index] = list_next(cached);
+			thread_cache.counts[bin_index]--;
+			cached->owner = thread_cache.id;
+
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+			cached->prev_free = NULL;
+#endif
+			RECORD_MALLOC(block_to_data(cached));
+			return block_to_data(cached);
+		}
+
+		// miss: take a few extra blocks of this exact size while we hold the lock
+		LOCK_HEAP();
+
+		while(heap->bins[bin_index] != NULL &&
+			thread_cache.counts[bin_index] < THREAD_CACHE_REFILL - 1) {
+			cached = heap->bins[bin_index];
+			remove_block(cached);
+			mark_used(cached);
+			push_thread_cache(cached, bin_index);
+		}
+	} else {
+		LOCK_HEAP();
+	}
+#else
+	LOCK_HEAP();
+#endif
+
+	BlockHeader* new_allocation = allocate_block(size, fresh);
+	UNLOCK_HEAP();
+
+	if(new_allocation == NULL)
+		return NULL;
+
+#ifdef MY_MALLOC_THREADS
+	// only small blocks go through the caches, so only they get an owner
+	new_allocation->owner = bin_index < NUM_SMALL_BINS ? thread_cache.id : 0;
+#endif
+
+	RECORD_MALLOC(block_to_data(new_allocation));
+	return block_to_data(new_allocation);
+}
+
+// allocate for a heap made by my_heap_create. Everything comes from the heap's own segments, even
+// huge allocations, and nothing goes through the thread caches or the slabs, so destroying the
+// heap gets rid of all of it.
+void* heap_allocate(Heap* handle, unsigned int size)
+{
+	int fresh;
+
+	if(size == 0 || size > MAX_ALLOCATION)
+		return NULL;
+
+	size = round_up_size(size);
+
+#ifdef MY_MALLOC_THREADS
+	// also makes this thread's stats visible to my_malloc_stats
+	if(!thread_cache.registered)
+		register_thread_cache();
+#endif
+
+	heap = handle;
+	LOCK_HEAP();
+
+	BlockHeader* block = allocate_block(size, &fresh);
+
+	// a block from the bins may still have the owner it had last time
+	if(block != NULL)
+		block->owner = 0;
+
+	UNLOCK_HEAP();
+
+	if(block == NULL)
+		return NULL;
+
+	RECORD_MALLOC(block_to_data(block));
+	return block_to_data(block);
+}
+
+// =================================================================================================
+// Size classes
+// =================================================================================================
+
+// Gives where class i ends: the next class's smallest size, or CLASS_TABLE_SIZE for the last.
+unsigned int class_end(const unsigned int* bounds, unsigned int count, unsigned int i) {
+	return i + 1 < count ? bounds[i + 1] : CLASS_TABLE_SIZE;
+}
+
+// Drops the class boundary that's missed least, merging its class into the one below it: the one
+// that makes the merged range smallest compared to its sizes. The first boundary and the ones
+// marked hot stay.
+void drop_class_bound(unsigned int* bounds, int* hot, unsigned int* count) {
+	unsigned int i, best = 0;
+
+	for(i = 1; i < *count; i++) {
+		if(hot[i])
+			continue;
+
+		// compares (end - start) / start without dividing
+		uint64_t range = class_end(bounds, *count, i) - bounds[i - 1];
+
+		if(best == 0 || range * bounds[best - 1] <
+			(uint64_t)(class_end(bounds, *count, best) - bounds[best - 1]) * bounds[i - 1])
+			best = i;
+	}
+
+	memmove(&bounds[best], &bounds[best + 1], (*count - best - 1) * sizeof(*bounds));
+	memmove(&hot[best], &hot[best + 1], (*count - best - 1) * sizeof(*hot));
+	(*count)--;
+}
+
+// Works out the smallest size of each of the table's classes: the formula's boundaries, but with
+// a class starting at each of the n sizes, so a request of that size takes the first block in its
+// bin. At most MY_MAX_SIZE_CLASSES sizes; the ones the table doesn't cover are skipped.
+void make_class_bounds(const unsigned int* sizes, unsigned int n, unsigned int* bounds) {
+	unsigned int with_room[NUM_TABLE_CLASSES + 1];
+	int hot[NUM_TABLE_CLASSES + 1] = {0};
+	unsigned int count, i, j;
+
+	// the smallest size past the small bins
+	with_room[0] = round_up_size(BIGGEST_BINNED_SIZE + 1);
+
+	for(count = 1; count < NUM_TABLE_CLASSES; count++)
+		with_room[count] = geometric_min_size(count);
+
+	for(i = 0; i < n; i++) {
+		unsigned int size = round_up_size(sizes[i]);
+
+		// small sizes have a bin each already
+		if(size <= BIGGEST_BINNED_SIZE || size >= CLASS_TABLE_SIZE)
+			continue;
+
+		for(j = 0; j < count && with_room[j] < size; j++)
+			;
+
+		if(j < count && with_room[j] == size) {
+			hot[j] = 1;
+			continue;
+		}
+
+		memmove(&with_room[j + 1], &with_room[j], (count - j) * sizeof(*with_room));
+		memmove(&hot[j + 1], &hot[j], (count - j) * sizeof(*hot));
+		with_room[j] = size;
+		hot[j] = 1;
+		count++;
+
+		drop_class_bound(with_room, hot, &count);
+	}
+
+	memcpy(bounds, with_room, sizeof(class_min_sizes));
+}
+
+// Switches the table's bins to the classes starting at bounds, or back to the formula if bounds is
+// NULL, moving every free block in those bins to its new one. The caller must hold every heap's
+// lock.
+void set_class_bounds(const unsigned int* bounds) {
+	BlockHeader* moving[MAX_HEAPS] = {};
+	unsigned long long dirty_low[MAX_HEAPS];
+	unsigned int index, bin, size;
+
+	// take the blocks out while the old classes still say which bins they're in
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		heap = heaps[index];
+		dirty_low[index] = heap->dirty_low;
+
+		for(bin = NUM_SMALL_BINS; bin < NUM_SMALL_BINS + NUM_TABLE_CLASSES; bin++) {
+			while(heap->bins[bin] != NULL) {
+				BlockHeader* block = heap->bins[bin];
+				unsigned int purged = block->purged;
+				unsigned int aged = block->aged;
+
+				// it isn't being reused, so its pages stay as purged (and as old) as they were
+				remove_block(block);
+				block->purged = purged;
+				block->aged = aged;
+				block->next_free = moving[index];
+				moving[index] = block;
+			}
+		}
+	}
+
+	if(bounds == NULL) {
+		custom_size_classes = 0;
+	} else {
+		memcpy(class_min_sizes, bounds, sizeof(class_min_sizes));
+
+		for(bin = 0; bin < NUM_TABLE_CLASSES; bin++) {
+			for(size = bounds[bin]; size < class_end(bounds, NUM_TABLE_CLASSES, bin);
+				size += SIZE_MULTIPLE)
+				size_classes[size / SIZE_MULTIPLE] = NUM_SMALL_BINS + bin;
+		}
+
+		custom_size_classes = 1;
+	}
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		heap = heaps[index];
+
+		while(moving[index] != NULL) {
+			BlockHeader* block = moving[index];
+
+			moving[index] = block->next_free;
+			insert_into_bin(block);
+		}
+
+		heap->dirty_low = dirty_low[index];
+	}
+}
+
+#ifdef MY_MALLOC_TRACE
+
+// =================================================================================================
+// Tracing
+// =================================================================================================
+
+uint64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Writes all of buf to the trace file, giving up if the file can't take it.
+void write_trace(const void* buf, size_t length) {
+
+	while(length != 0) {
+		ssize_t written = write(trace_fd, buf, length);
+
+		if(written < 0 && errno == EINTR)
+			continue;
+
+		if(written <= 0)
+			return;
+
+		buf = (const char*)buf + written;
+		length -= written;
+	}
+}
+
+// Writes out whatever the buffer's owner has added since it was last drained. The caller holds
+// trace_lock.
+void drain_trace_buffer(TraceBuffer* buffer) {
+
+	unsigned long tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+	unsigned long head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+
+	while(tail != head) {
+		// as far as the end of the ring at a time
+		unsigned long index = tail % TRACE_BUFFER_RECORDS;
+		unsigned long count = head - tail;
+
+		if(count > TRACE_BUFFER_RECORDS - index)
+			count = TRACE_BUFFER_RECORDS - index;
+
+		if(trace_fd >= 0)
+			write_trace(&buffer->records[index], count * sizeof(struct my_trace_record));
+
+		tail += count;
+	}
+
+	atomic_store_explicit(&buffer->tail, tail, memory_order_release);
+}
+
+// Drains every buffer. The caller holds trace_lock.
+void drain_trace_buffers() {
+
+	TraceBuffer* buffer;
+
+	for(buffer = trace_buffers; buffer != NULL; buffer = buffer->next)
+		drain_trace_buffer(buffer);
+}
+
+void* run_trace_writer(void* unused) {
+
+	(void)unused;
+
+	struct timespec interval = {TRACE_DRAIN_MS / 1000, (TRACE_DRAIN_MS % 1000) * 1000000L};
+
+	while(atomic_load_explicit(&tracing, memory_order_acquire)) {
+		nanosleep(&interval, NULL);
+
+		pthread_mutex_lock(&trace_lock);
+		drain_trace_buffers();
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	return NULL;
+}
+
+// Runs when a thread exits. Its records stay in the buffer until they're drained, but the next
+// new thread can write after them.
+void release_trace_buffer(void* buffer) {
+
+	pthread_mutex_lock(&trace_lock);
+	((TraceBuffer*)buffer)->owned = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void make_trace_key() {
+	pthread_key_create(&trace_key, release_trace_buffer);
+}
+
+// Gives the calling thread a buffer, taking over one that an exited thread left if there is one.
+// Gives NULL if it runs out of memory.
+TraceBuffer* claim_trace_buffer() {
+
+	TraceBuffer* buffer;
+
+	pthread_once(&trace_key_once, make_trace_key);
+	pthread_mutex_lock(&trace_lock);
+
+	for(buffer = trace_buffers; buffer != NULL && buffer->owned; buffer = buffer->next)
+		;
+
+	if(buffer == NULL) {
+		// it's all zero from the kernel, so the ring starts out empty
+		buffer = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if(buffer == MAP_FAILED) {
+			pthread_mutex_unlock(&trace_lock);
+			return NULL;
+		}
+
+		buffer->next = trace_buffers;
+		trace_buffers = buffer;
+	}
+
+	buffer->owned = 1;
+	trace_thread = next_trace_thread++;
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_setspecific(trace_key, buffer);
+	trace_buffer = buffer;
+	return buffer;
+}
+
+// Adds a record of one call to the calling thread's buffer. Use TRACE_CALL instead of calling it.
+void trace_call(uint8_t op, void* address, void* old_address, unsigned int size) {
+
+	if(in_trace_call)
+		return;
+
+	in_trace_call = 1;
+	TraceBuffer* buffer = trace_buffer != NULL ? trace_buffer : claim_trace_buffer();
+
+	if(buffer != NULL) {
+		unsigned long head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+
+		// full: don't wait for the writer thread
+		if(head - atomic_load_explicit(&buffer->tail, memory_order_acquire) == TRACE_BUFFER_RECORDS) {
+			pthread_mutex_lock(&trace_lock);
+			drain_trace_buffer(buffer);
+			pthread_mutex_unlock(&trace_lock);
+		}
+
+		struct my_trace_record* record = &buffer->records[head % TRACE_BUFFER_RECORDS];
+		record->timestamp = monotonic_ns() - trace_start;
+		record->address = (uintptr_t)address;
+		record->old_address = (uintptr_t)old_address;
+		record->size = size;
+		record->thread = trace_thread;
+		record->op = op;
+		record->unused = 0;
+		atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+	}
+
+	in_trace_call = 0;
+}
+
+// A forked child has no writer thread, and shouldn't write into its parent's file.
+void stop_tracing_in_child() {
+
+	atomic_store_explicit(&tracing, 0, memory_order_relaxed);
+	pthread_mutex_init(&trace_lock, NULL);
+
+	if(trace_fd >= 0)
+		close(trace_fd);
+
+	trace_fd = -1;
+	trace_writer_running = 0;
+}
+
+#endif
+
+// =================================================================================================
+// Public functions
+// =================================================================================================
+
+void* my_malloc(unsigned int size)
+{
+	int fresh;
+	void* ptr = allocate(size, &fresh);
+
+	TRACE_CALL(MY_TRACE_MALLOC, ptr, NULL, size);
+	return ptr;
+}
+
+void* my_malloc_at_least(unsigned int size, unsigned int* actual)
+{
+	void* ptr = my_malloc(size);
+
+	*actual = ptr != NULL ? usable_size(ptr) : 0;
+	return ptr;
+}
+
+void* my_calloc(unsigned int nmemb, unsigned int size)
+{
+	if(size != 0 && nmemb > UINT_MAX / size)
+		return NULL;
+
+	int fresh;
+	void* ptr = allocate(nmemb * size, &fresh);
+
+	// only recycled memory needs clearing
+	if(ptr != NULL && !fresh)
+		memset(ptr, 0, nmemb * size);
+
+	TRACE_CALL(MY_TRACE_CALLOC, ptr, NULL, nmemb * size);
+	return ptr;
+}
+
+unsigned int my_malloc_batch(unsigned int size, unsigned int n, void** out)
+{
+	unsigned int count = 0;
+	int fresh;
+
+	if(size == 0 || size > MAX_ALLOCATION)
+		return 0;
+
+#ifdef MY_MALLOC_THREADS
+	// before local_heap, so this thread gets its node's heap and its stats are counted
+	if(!thread_cache.registered)
+		register_thread_cache();
+#endif
+
+	unsigned int requested = size;
+	size = round_up_size(size);
+	unsigned int bin_index = size_to_bin(size);
+
+	// huge ones each get their own mmap anyway
+	if(size >= mmap_threshold) {
+		while(count < n && (out[count] = allocate(size, &fresh)) != NULL)
+			count++;
+
+		TRACE_MALLOCS(out, count, requested);
+		return count;
+	}
+
+
+#ifdef MY_MALLOC_SLABS
+	if(bin_index < NUM_SMALL_BINS) {
+		LOCK_SLABS();
+
+		while(count < n && (out[count] = slab_alloc(bin_index, &fresh)) != NULL)
+			count++;
+
+		UNLOCK_SLABS();
+
+		// the rest come from the heap if the slab region is full
+		if(count == n) {
+			RECORD_MALLOCS(out, count);
+			TRACE_MALLOCS(out, count, requested);
+			return count;
+		}
+	}
+#endif
+
+#ifdef MY_MALLOC_THREADS
+	// whatever this thread has cached goes first, with no lock needed
+	if(bin_index < NUM_SMALL_BINS) {
+		while(count < n && thread_cache.blocks[bin_index] != NULL) {
+			BlockHeader* cached = thread_cache.blocks[bin_index];
+			thread_cache.blocks[bin_index] = list_next(cached);
+			thread_cache.counts[bin_index]--;
+			cached->owner = thread_cache.id;
+
+#ifdef MY_MALLOC_DOUBLE_FREE_CHECKS
+			cached->prev_free = NULL;
+#endif
+			out[count++] = block_to_data(cached);
+		}
+	}
+
+	unsigned int first_from_heap = count;
+#endif
+
+	heap = local_heap();
+	LOCK_HEAP();
+
+	if(bin_index < NUM_SMALL_BINS)
+		count += take_bin_run(bin_index, n - count, out + count);
+
+	count += carve_top_run(size, n - count, out + count);
+
+	// if the heap couldn't grow for all of them at once, get what we can one at a time
+	while(count < n) {
+		BlockHeader* block = allocate_block(size, &fresh);
+
+		if(block == NULL)
+			break;
+
+		out[count++] = block_to_data(block);
+	}
+
+	UNLOCK_HEAP();
+
+#ifdef MY_MALLOC_THREADS
+	// same as allocate: only small blocks go through the caches, so only they get an owner
+	unsigned int i;
+
+	for(i = first_from_heap; i < count; i++) {
+		BlockHeader* block = data_to_block(out[i]);
+		block->owner = size_to_bin(block->size) < NUM_SMALL_BINS ? thread_cache.id : 0;
+	}
+#endif
+
+	RECORD_MALLOCS(out, count);
+	TRACE_MALLOCS(out, count, requested);
+	return count;
+}
+
+// What my_free and my_realloc share. ptr can't be NULL.
+void free_pointer(void* ptr)
+{
+#ifdef MY_MALLOC_THREADS
+	// also makes this thread's stats visible to my_malloc_stats
+	if(!thread_cache.registered)
+		register_thread_cache();
+#endif
+
+	RECORD_FREE(ptr);
+
+#ifdef MY_MALLOC_SLABS
+	if(is_slab_pointer(ptr)) {
+		LOCK_SLABS();
+		slab_free(ptr);
+		UNLOCK_SLABS();
+		return;
+	}
+#endif
+
+	BlockHeader* block = data_to_block(ptr);
+
+	check_block_to_free(block);
+
+	if(block->mmapped) {
+		free_mmapped_block(block);
+		return;
+	}
+
+	heap = heap_of(block);
+
+#ifdef MY_MALLOC_THREADS
+	unsigned int bin_index = size_to_bin(block->size);
+
+	if(bin_index < NUM_SMALL_BINS) {
+		// another thread's block: hand it back without touching its cache or the lock
+		if(block->owner != 0 && block->owner != thread_cache.id) {
+			push_remote_free(block);
+			return;
+		}
+
+		// Our cache only holds blocks from our own heap, so it can flush them under one lock, and
+		// once this thread's cache is gone, blocks go straight back to the heap.
+		if(heap != local_heap() || thread_cache.shutting_down) {
+			LOCK_HEAP();
+			release_block(block);
+			UNLOCK_HEAP();
+			return;
+		}
+
+		push_thread_cache(block, bin_index);
+
+		if(thread_cache.counts[bin_index] <= THREAD_CACHE_LIMIT)
+			return;
+
+		// over the limit: give the older half back to bins[], keeping the hot blocks on top
+		BlockHeader* keep = block;
+		unsigned int i;
+
+		for(i = 1; i < THREAD_CACHE_LIMIT / 2; i++)
+			keep = list_next(keep);
+
+		BlockHeader* release = list_next(keep);
+		set_list_next(keep, NULL);
+		thread_cache.counts[bin_index] = THREAD_CACHE_LIMIT / 2;
+
+		LOCK_HEAP();
+		free_block_list(release);
+		UNLOCK_HEAP();
+		return;
+	}
+#endif
+
+	LOCK_HEAP();
+	release_block(block);
+	UNLOCK_HEAP();
+}
+
+void my_free(void* ptr)
+{
+	if(ptr == NULL)
+		return;
+
+	TRACE_CALL(MY_TRACE_FREE, ptr, NULL, 0);
+	free_pointer(ptr);
+}
+
+void my_free_sized(void* ptr, unsigned int size)
+{
+	if(ptr == NULL)
+		return;
+
+#ifdef MY_MALLOC_SLABS
+	assert(!is_slab_pointer(ptr) || size <= slab_page_of(ptr)->object_size);
+	assert(is_slab_pointer(ptr) || size <= data_to_block(ptr)->size);
+#else
+	assert(size <= data_to_block(ptr)->size);
+#endif
+
+	my_free(ptr);
+}
+
+// For sorting pointers by address with qsort.
+int compare_pointers(const void* a, const void* b)
+{
+	uintptr_t left = (uintptr_t)*(void* const*)a;
+	uintptr_t right = (uintptr_t)*(void* const*)b;
+
+	return left < right ? -1 : left > right;
+}
+
+void my_free_batch(void** ptrs, unsigned int n)
+{
+#ifdef MY_MALLOC_THREADS
+	// before local_heap, and outside the lock, since registering can allocate
+	if(!thread_cache.registered)
+		register_thread_cache();
+#endif
+
+	// Sorted, blocks that are physical neighbors end up next to each other. Do it before taking
+	// the lock, in case qsort needs memory.
+	qsort(ptrs, n, sizeof(void*), compare_pointers);
+
+	// the run of neighboring blocks waiting to be freed together
+	BlockHeader* run = NULL;
+	unsigned int i;
+
+#ifdef MY_MALLOC_TRACE
+	// before taking the lock too, since a thread's first record can allocate
+	for(i = 0; i < n; i++) {
+		if(ptrs[i] != NULL)
+			TRACE_CALL(MY_TRACE_FREE, ptrs[i], NULL, 0);
+	}
+#endif
+
+	heap = local_heap();
+	LOCK_HEAP();
+
+	for(i = 0; i < n; i++) {
+		if(ptrs[i] == NULL)
+			continue;
+
+		RECORD_FREE(ptrs[i]);
+
+		BlockHeader* block = data_to_block(ptrs[i]);
+
+#ifdef MY_MALLOC_SLABS
+		int slab = is_slab_pointer(ptrs[i]);
+#else
+		int slab = 0;
+#endif
+
+		if(!slab)
+			check_block_to_free(block);
+
+		if(!slab && block->mmapped) {
+			free_mmapped_block(block);
+			continue;
+		}
+
+		// The rest have to go back under their heap's lock. The default heap's lock is also the
+		// slab lock.
+		Heap* owner = slab ? &default_heap : heap_of(block);
+
+		if(owner != heap) {
+			if(run != NULL)
+				free_block(run);
+
+			run = NULL;
+			UNLOCK_HEAP();
+			heap = owner;
+			LOCK_HEAP();
+		}
+
+#ifdef MY_MALLOC_SLABS
+		if(slab) {
+			slab_free(ptrs[i]);
+			continue;
+		}
+#endif
+
+		// both are still in use, so they merge without touching the bins
+		if(run != NULL && next_phys(run) == block) {
+			run->size += BLOCK_OVERHEAD + block->size;
+			continue;
+		}
+
+		if(run != NULL)
+			free_block(run);
+
+		run = block;
+	}
+
+	if(run != NULL)
+		free_block(run);
+
+	UNLOCK_HEAP();
+}
+
+// What my_realloc does for a ptr that isn't NULL.
+void* reallocate(void* ptr, unsigned int size)
+{
+	int fresh;
+
+	if(size == 0) {
+		free_pointer(ptr);
+		return NULL;
+	}
+
+	if(size > MAX_ALLOCATION)
+		return NULL;
+
+#ifdef MY_MALLOC_SLABS
+	if(is_slab_pointer(ptr)) {
+		// objects can't grow, but anything that still fits can stay, even if it rounds up past it
+		unsigned int object_size = slab_page_of(ptr)->object_size;
+
+		if(size <= object_size)
+			return ptr;
+
+		void* new_ptr = allocate(size, &fresh);
+
+		if(new_ptr != NULL) {
+			memcpy(new_ptr, ptr, object_size);
+			free_pointer(ptr);
+		}
+
+		return new_ptr;
+	}
+#endif
+
+	size = round_up_size(size);
+
+	BlockHeader* block = data_to_block(ptr);
+	unsigned int old_size = block->size;
+
+	check_block_to_free(block);
+
+	if(block->mmapped) {
+		unsigned int length = round_up_to_pages(size + BLOCK_HEADER_SIZE);
+
+		if(length < size)
+			return NULL;
+
+		// let the kernel move the pages instead of copying them
+		BlockHeader* moved = mremap(block, old_size + BLOCK_HEADER_SIZE, length, MREMAP_MAYMOVE);
+
+		STAT_ADD(STAT_MMAP_CALLS, 1);
+
+		if(moved != MAP_FAILED) {
+			moved->size = length - BLOCK_HEADER_SIZE;
+			STAT_ADD(STAT_BYTES_MMAPPED, (long long)moved->size - old_size);
+			STAT_ADD(STAT_BYTES_IN_USE, (long long)moved->size - old_size);
+			return block_to_data(moved);
+		}
+	} else {
+		int resized = 1;
+		heap = heap_of(block);
+		LOCK_HEAP();
+
+		if(size <= block->size)
+			shrink_block(block, size);
+		else
+			resized = grow_block_in_place(block, size);
+
+		UNLOCK_HEAP();
+
+		if(resized) {
+			STAT_ADD(STAT_BYTES_IN_USE, (long long)block->size - old_size);
+			return ptr;
+		}
+	}
+
+	// last resort: move it, keeping a handle's blocks in their own heap
+	void* new_ptr = !block->mmapped && heap_of(block)->handle ?
+		heap_allocate(heap_of(block), size) : allocate(size, &fresh);
+
+	if(new_ptr == NULL)
+		return NULL;
+
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	free_pointer(ptr);
+	return new_ptr;
+}
+
+void* my_realloc(void* ptr, unsigned int size)
+{
+	if(ptr == NULL)
+		return my_malloc(size);
+
+	void* new_ptr = reallocate(ptr, size);
+
+	TRACE_CALL(MY_TRACE_REALLOC, new_ptr, ptr, size);
+	return new_ptr;
+}
+
+unsigned int my_malloc_usable_size(void* ptr)
+{
+	return ptr != NULL ? usable_size(ptr) : 0;
+}
+
+void* my_memalign(unsigned int alignment, unsigned int size)
+{
+	if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+		return NULL;
+
+	// every block is already this aligned
+	if(alignment <= SIZE_MULTIPLE)
+		return my_malloc(size);
+
+	if(size == 0 || size > MAX_ALLOCATION)
+		return NULL;
+
+#ifdef MY_MALLOC_THREADS
+	// before local_heap, so this thread gets its node's heap and its stats are counted
+	if(!thread_cache.registered)
+		register_thread_cache();
+#endif
+
+	heap = local_heap();
+	LOCK_HEAP();
+	BlockHeader* block = allocate_aligned_block(alignment, size);
+	UNLOCK_HEAP();
+
+	if(block == NULL)
+		return NULL;
 
-	allocated_portion->in_use = 1;
-	allocated_portion->size = allocation_size;
-	empty_portion->in_use = 0;
-	empty_portion->size = (old_block_size - allocation_size) - BLOCK_HEADER_SIZE;
+#ifdef MY_MALLOC_THREADS
+	// same as allocate: only small blocks go through the caches, so only they get an owner
+	block->owner = size_to_bin(block->size) < NUM_SMALL_BINS ? thread_cache.id : 0;
+#endif
+
+	RECORD_MALLOC(block_to_data(block));
+	TRACE_CALL(MY_TRACE_MALLOC, block_to_data(block), NULL, size);
+	return block_to_data(block);
+}
 
-	// link allocated portion and empty portion
-	allocated_portion->next_phys = empty_portion;
-	empty_portion->prev_phys = allocated_portion;
+void* my_aligned_alloc(unsigned int alignment, unsigned int size)
+{
+	return my_memalign(alignment, size);
+}
 
-	// link empty portion with next block
-	empty_portion->next_phys = next_block;
+int my_posix_memalign(void** memptr, unsigned int alignment, unsigned int size)
+{
+	if(alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
 
-	if(next_block != NULL) {
-		next_block->prev_phys = empty_portion;
-	} else {
-		heap_tail = empty_portion;
+	void* ptr = my_memalign(alignment, size);
+
+	if(ptr == NULL && size != 0)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+int my_mallopt(int param, int value)
+{
+	if(value < 0)
+		return 0;
+
+	int ok = 1;
+	unsigned int index;
+	lock_all_heaps();
+
+	switch(param) {
+		case MY_M_TRIM_THRESHOLD:  trim_threshold = value;  break;
+		case MY_M_PURGE_THRESHOLD: purge_threshold = value; break;
+		case MY_M_TOP_PAD:         top_pad = value;         break;
+		case MY_M_MMAP_THRESHOLD:  mmap_threshold = value;  break;
+
+		case MY_M_MXFAST:
+			if(value > BIGGEST_BINNED_SIZE) {
+				ok = 0;
+			} else {
+				// anything waiting that's now too big for the fast bins has to be merged
+				fast_max = value;
+
+				for(index = 0; index < MAX_HEAPS; index++) {
+					if(heaps[index] != NULL) {
+						heap = heaps[index];
+						consolidate_fast_bins();
+					}
+				}
+			}
+			break;
+
+		case MY_M_GROW_CHUNK:
+			// must be a power of two, and at least keep sbrk'd blocks aligned
+			if(value < SIZE_MULTIPLE || (value & (value - 1)) != 0)
+				ok = 0;
+			else
+				grow_chunk = value;
+			break;
+
+		default: ok = 0; break;
 	}
 
-	// insert empty portion of split block to appropriate bin
-	insert_into_bin(empty_portion);
+	unlock_all_heaps();
+	return ok;
+}
 
-	return allocated_portion;
+int my_malloc_trim(unsigned int pad)
+{
+	int released = 0;
+	unsigned int index;
+
+#ifdef MY_MALLOC_THREADS
+	heap = local_heap();
+	LOCK_HEAP();
+	flush_thread_cache();
+	UNLOCK_HEAP();
+#endif
+
+	LOCK_HEAP_LIST();
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		heap = heaps[index];
+		LOCK_HEAP();
+		consolidate_fast_bins();
+		released |= trim_top(pad);
+		released |= purge_heap(1) != 0;
+		UNLOCK_HEAP();
+	}
+
+	UNLOCK_HEAP_LIST();
+	return released;
 }
 
-// =================================================================================================
-// Public functions
-// =================================================================================================
+int my_malloc_purge()
+{
+	int released = 0;
+	unsigned int index;
 
-void* my_malloc(unsigned int size)
+	LOCK_HEAP_LIST();
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		heap = heaps[index];
+		LOCK_HEAP();
+		released |= purge_heap(0) != 0;
+		UNLOCK_HEAP();
+	}
+
+	UNLOCK_HEAP_LIST();
+	return released;
+}
+
+int my_malloc_set_size_classes(const unsigned int* sizes, unsigned int n)
+{
+	unsigned int bounds[NUM_TABLE_CLASSES];
+
+	if(n > MY_MAX_SIZE_CLASSES)
+		return 0;
+
+	make_class_bounds(sizes, n, bounds);
+
+	lock_all_heaps();
+	set_class_bounds(n != 0 ? bounds : NULL);
+	unlock_all_heaps();
+	return 1;
+}
+
+void my_malloc_sample_sizes(int on)
+{
+	unsigned int index;
+
+	if(on && !sampling_sizes) {
+		for(index = 0; index < CLASS_TABLE_SIZE / SIZE_MULTIPLE; index++)
+			size_samples[index] = 0;
+	}
+
+	sampling_sizes = on;
+}
+
+int my_malloc_tune_size_classes()
+{
+	unsigned int sizes[MY_MAX_SIZE_CLASSES];
+	unsigned int counts[MY_MAX_SIZE_CLASSES];
+	unsigned long long total = 0;
+	unsigned int n = 0, index, i;
+
+	for(index = 0; index < CLASS_TABLE_SIZE / SIZE_MULTIPLE; index++)
+		total += size_samples[index];
+
+	if(total == 0)
+		return 0;
+
+	// keep the most sampled sizes, most first, clearing the samples for the next round
+	for(index = 0; index < CLASS_TABLE_SIZE / SIZE_MULTIPLE; index++) {
+		unsigned int count = size_samples[index];
+
+		size_samples[index] = 0;
+
+		if(count == 0 || count * (unsigned long long)TUNED_CLASS_SHARE < total)
+			continue;
+
+		if(n == MY_MAX_SIZE_CLASSES && count <= counts[n - 1])
+			continue;
+
+		if(n < MY_MAX_SIZE_CLASSES)
+			n++;
+
+		for(i = n - 1; i > 0 && counts[i - 1] < count; i--) {
+			counts[i] = counts[i - 1];
+			sizes[i] = sizes[i - 1];
+		}
+
+		counts[i] = count;
+		sizes[i] = index * SIZE_MULTIPLE;
+	}
+
+	my_malloc_set_size_classes(sizes, n);
+	return n;
+}
+
+MyArena* my_arena_create(unsigned int chunk_size)
+{
+	MyArena* arena = my_malloc(sizeof(MyArena));
+
+	if(arena == NULL)
+		return NULL;
+
+	arena->chunks = NULL;
+	arena->current = NULL;
+	arena->bump = NULL;
+	arena->end = NULL;
+	arena->chunk_size = chunk_size != 0 ?
+		(chunk_size + (SIZE_MULTIPLE - 1)) & ~(SIZE_MULTIPLE - 1) : DEFAULT_ARENA_CHUNK;
+	return arena;
+}
+
+void* my_arena_alloc(MyArena* arena, unsigned int size)
 {
 	if(size == 0)
 		return NULL;
 
-	size = round_up_size(size);
+	// keep the same alignment my_malloc gives
+	size = (size + (SIZE_MULTIPLE - 1)) & ~(SIZE_MULTIPLE - 1);
 
-	unsigned int bin_index = size_to_bin(size);
+	if(size == 0)
+		return NULL;
 
-	BlockHeader* current = bins[bin_index];
-	BlockHeader* new_allocation = NULL;
+	if(arena->current != NULL && size <= (size_t)(arena->end - arena->bump)) {
+		void* ptr = arena->bump;
+		arena->bump += size;
+		return ptr;
+	}
 
-	if(bin_index < OVERFLOW_BIN && current != NULL) {
-		// remove block from a small bin
-		new_allocation = current;
-		new_allocation->in_use = 1;
-		remove_block(current);
-	} else if(bin_index < OVERFLOW_BIN && current == NULL) {
-		// try to find block big enough to split in the small bins
-		BlockHeader* block_to_split = NULL;
-		int index;
-		for(index = size_to_bin(size + MINIMUM_BLOCK_SIZE); index < OVERFLOW_BIN; index++) {
+	// Anything over half a chunk gets a chunk of its own, so it doesn't waste what's left of the
+	// current one. Either way the chunk comes from my_malloc, which maps the big ones.
+	int own_chunk = size > arena->chunk_size / 2;
+	unsigned int data_size = own_chunk ? size : arena->chunk_size;
 
-			if(bins[index] != NULL) {
+	// my_malloc takes an unsigned int, so anything bigger would be cut short
+	if(data_size > UINT_MAX - sizeof(ArenaChunk))
+		return NULL;
 
-				block_to_split = bins[index];
+	ArenaChunk* chunk = my_malloc(data_size + sizeof(ArenaChunk));
 
-				if((block_to_split->size - size) < MINIMUM_BLOCK_SIZE) {
-					block_to_split = NULL;
-					continue;
-				}
-				remove_block(block_to_split);
-				break;
+	if(chunk == NULL)
+		return NULL;
+
+	chunk->next = arena->chunks;
+	chunk->size = data_size;
+	arena->chunks = chunk;
+
+	char* data = ptr_add_bytes(chunk, sizeof(ArenaChunk));
+
+	if(!own_chunk) {
+		arena->current = chunk;
+		arena->bump = data + size;
+		arena->end = data + data_size;
+	}
+
+	return data;
+}
+
+void my_arena_reset(MyArena* arena)
+{
+	ArenaChunk* chunk = arena->chunks;
+
+	// keep the current chunk to start over in, and free the rest
+	while(chunk != NULL) {
+		ArenaChunk* next = chunk->next;
+
+		if(chunk != arena->current)
+			my_free(chunk);
+
+		chunk = next;
+	}
+
+	arena->chunks = arena->current;
+
+	if(arena->current != NULL) {
+		arena->current->next = NULL;
+		arena->bump = ptr_add_bytes(arena->current, sizeof(ArenaChunk));
+	}
+}
+
+void my_arena_destroy(MyArena* arena)
+{
+	ArenaChunk* chunk = arena->chunks;
+
+	while(chunk != NULL) {
+		ArenaChunk* next = chunk->next;
+		my_free(chunk);
+		chunk = next;
+	}
+
+	my_free(arena);
+}
+
+MyHeap* my_heap_create()
+{
+	LOCK_HEAP_LIST();
+	Heap* made = make_heap(-1);
+
+	if(made != NULL)
+		made->handle = 1;
+
+	UNLOCK_HEAP_LIST();
+	return made;
+}
+
+void* my_heap_malloc(MyHeap* handle, unsigned int size)
+{
+	void* ptr = heap_allocate(handle, size);
+	TRACE_CALL(MY_TRACE_MALLOC, ptr, NULL, size);
+	return ptr;
+}
+
+void my_heap_free(MyHeap* handle, void* ptr)
+{
+	if(ptr == NULL)
+		return;
+
+	assert(heap_of(data_to_block(ptr)) == handle);
+	my_free(ptr);
+}
+
+void my_heap_destroy(MyHeap* handle)
+{
+	Segment* segment = handle->segment;
+	BlockHeader* block;
+
+	LOCK_HEAP_LIST();
+	heaps[handle->index] = NULL;
+	UNLOCK_HEAP_LIST();
+
+	heap = handle;
+	LOCK_HEAP();
+
+	// what's waiting in the fast bins has already been counted as freed
+	consolidate_fast_bins();
+
+	while(segment != NULL) {
+		Segment* prev = segment->prev;
+
+		// whatever is still allocated goes with it
+		for(block = segment_first_block(segment); block != segment->fence;
+			block = next_phys(block)) {
+			if(block->in_use) {
+				STAT_ADD(STAT_FREES, 1);
+				STAT_ADD(STAT_BYTES_IN_USE, -(long long)block->size);
 			}
 		}
-		// if one found, split it
-		if(block_to_split != NULL) {
-			new_allocation = split_block(block_to_split, size);
+
+		STAT_ADD(STAT_BYTES_HEAP, -(long long)bytes_between_ptrs(segment, segment_end(segment)));
+		STAT_ADD(STAT_MUNMAP_CALLS, 1);
+		munmap(segment, bytes_between_ptrs(segment, segment->reserved_end));
+		segment = prev;
+	}
+
+	UNLOCK_HEAP();
+
+#ifdef MY_MALLOC_THREADS
+	pthread_mutex_destroy(&handle->lock);
+#endif
+
+	STAT_ADD(STAT_MUNMAP_CALLS, 1);
+	munmap(handle, sizeof(Heap));
+}
+
+int my_malloc_stats(struct my_stats* out)
+{
+	memset(out, 0, sizeof(*out));
+
+#ifdef MY_MALLOC_NO_STATS
+	return 0;
+#else
+	long long totals[NUM_STATS] = {};
+	unsigned int stat, bin_index, index;
+
+	heap = &default_heap;
+	LOCK_HEAP();
+
+#ifdef MY_MALLOC_THREADS
+	unsigned int id;
+
+	for(stat = 0; stat < NUM_STATS; stat++)
+		totals[stat] = exited_thread_stats[stat];
+
+	for(id = 1; id < MAX_THREAD_CACHES; id++) {
+		if(live_thread_stats[id] != NULL) {
+			for(stat = 0; stat < NUM_STATS; stat++)
+				totals[stat] += atomic_load_explicit(&live_thread_stats[id]->counters[stat],
+					memory_order_relaxed);
 		}
 	}
+#else
+	for(stat = 0; stat < NUM_STATS; stat++)
+		totals[stat] = stats.counters[stat];
+#endif
 
-	if(new_allocation == NULL) {
-		current = bins[OVERFLOW_BIN];
-		BlockHeader* block_to_split = NULL;
-
-		// first fit
-		while(current != NULL) {
-			if(current->size >= size) {
-
-				if(((current->size - size) >= MINIMUM_BLOCK_SIZE)) {
-					// split block
-					block_to_split = current;
-					new_allocation = split_block(block_to_split, size);
-				} else {
-					// use full block
-					new_allocation = current;
-					new_allocation->in_use = 1;
-					remove_block(new_allocation);
-				}
-				break;
-			} else {
-				current = current->next_free;
+	UNLOCK_HEAP();
+	LOCK_HEAP_LIST();
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		heap = heaps[index];
+		LOCK_HEAP();
+
+		for(bin_index = 0; bin_index < NUM_BINS; bin_index++)
+			out->bin_free_counts[bin_index] += heap->bin_free_counts[bin_index];
+
+		out->bytes_dirty += heap->dirty_bytes;
+
+		UNLOCK_HEAP();
+	}
+
+	UNLOCK_HEAP_LIST();
+
+	out->bytes_in_use = totals[STAT_BYTES_IN_USE];
+	out->bytes_heap = totals[STAT_BYTES_HEAP];
+	out->bytes_mmapped = totals[STAT_BYTES_MMAPPED];
+	out->mallocs = totals[STAT_MALLOCS];
+	out->frees = totals[STAT_FREES];
+	out->splits = totals[STAT_SPLITS];
+	out->coalesces = totals[STAT_COALESCES];
+	out->sbrk_calls = totals[STAT_SBRK_CALLS];
+	out->brk_calls = totals[STAT_BRK_CALLS];
+	out->mmap_calls = totals[STAT_MMAP_CALLS];
+	out->munmap_calls = totals[STAT_MUNMAP_CALLS];
+	out->overflow_searches = totals[STAT_OVERFLOW_SEARCHES];
+	out->overflow_steps = totals[STAT_OVERFLOW_STEPS];
+	out->purged_bytes = totals[STAT_PURGED_BYTES];
+	out->num_bins = NUM_BINS;
+
+	for(bin_index = 0; bin_index < NUM_BINS; bin_index++)
+		out->bin_min_sizes[bin_index] = bin_min_size(bin_index);
+
+	return 1;
+#endif
+}
+
+void my_malloc_stats_print()
+{
+	struct my_stats stats;
+	unsigned int bin_index;
+
+	if(!my_malloc_stats(&stats)) {
+		fprintf(stderr, "my_malloc: built without stats\n");
+		return;
+	}
+
+	fprintf(stderr, "bytes in use:      %llu\n", stats.bytes_in_use);
+	fprintf(stderr, "heap bytes:        %llu\n", stats.bytes_heap);
+	fprintf(stderr, "mmapped bytes:     %llu\n", stats.bytes_mmapped);
+	fprintf(stderr, "mallocs:           %llu\n", stats.mallocs);
+	fprintf(stderr, "frees:             %llu\n", stats.frees);
+	fprintf(stderr, "splits:            %llu\n", stats.splits);
+	fprintf(stderr, "coalesces:         %llu\n", stats.coalesces);
+	fprintf(stderr, "sbrk/brk calls:    %llu/%llu\n", stats.sbrk_calls, stats.brk_calls);
+	fprintf(stderr, "mmap/munmap calls: %llu/%llu\n", stats.mmap_calls, stats.munmap_calls);
+	fprintf(stderr, "overflow searches: %llu (%llu blocks looked at)\n", stats.overflow_searches,
+		stats.overflow_steps);
+	fprintf(stderr, "dirty free bytes:  %llu (%llu purged so far)\n", stats.bytes_dirty,
+		stats.purged_bytes);
+	fprintf(stderr, "free blocks by bin:\n");
+
+	for(bin_index = 0; bin_index < stats.num_bins; bin_index++) {
+		if(stats.bin_free_counts[bin_index] != 0)
+			fprintf(stderr, "  >= %8uB: %llu\n", stats.bin_min_sizes[bin_index],
+				stats.bin_free_counts[bin_index]);
+	}
+}
+
+// Visits every block in segment and the segments before it, oldest first, and gives how many
+// bytes they all span. The caller holds the heap lock.
+unsigned long long walk_segments(Segment* segment,
+	void (*visit)(const struct my_block_info* info, void* arg), void* arg) {
+
+	if(segment == NULL)
+		return 0;
+
+	unsigned long long bytes = walk_segments(segment->prev, visit, arg);
+	BlockHeader* block = segment_first_block(segment);
+	struct my_block_info info;
+
+	while(block != segment->fence) {
+		info.address = block_to_data(block);
+		info.size = block->size;
+		info.in_use = block->in_use;
+		visit(&info, arg);
+		block = next_phys(block);
+	}
+
+	return bytes + bytes_between_ptrs(segment, segment_end(segment));
+}
+
+// Walks every heap's segments, a heap at a time, and gives how many bytes they all span.
+unsigned long long walk_heaps(void (*visit)(const struct my_block_info* info, void* arg),
+	void* arg) {
+
+	unsigned long long bytes = 0;
+	unsigned int index;
+
+	LOCK_HEAP_LIST();
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		heap = heaps[index];
+		LOCK_HEAP();
+		bytes += walk_segments(heap->segment, visit, arg);
+		UNLOCK_HEAP();
+	}
+
+	UNLOCK_HEAP_LIST();
+	return bytes;
+}
+
+void my_heap_walk(void (*visit)(const struct my_block_info* info, void* arg), void* arg)
+{
+	walk_heaps(visit, arg);
+}
+
+// my_heap_summarize's visitor. Adds one block to the summary in arg.
+void summarize_block(const struct my_block_info* info, void* arg) {
+
+	struct my_heap_summary* summary = arg;
+
+	if(info->in_use) {
+		summary->used_blocks++;
+		summary->used_bytes += info->size;
+		return;
+	}
+
+	summary->free_blocks++;
+	summary->free_bytes += info->size;
+	summary->free_histogram[size_to_bin(info->size)]++;
+
+	if(info->size > summary->largest_free)
+		summary->largest_free = info->size;
+}
+
+// Gives how many bytes of the mapping from start to end are in some heap's segments, counting
+// the room a mapped segment has reserved to grow into. The caller holds every heap's lock.
+unsigned long long bytes_in_segments(uintptr_t start, uintptr_t end) {
+
+	unsigned long long bytes = 0;
+	unsigned int index;
+	Segment* segment;
+
+	for(index = 0; index < MAX_HEAPS; index++) {
+		if(heaps[index] == NULL)
+			continue;
+
+		for(segment = heaps[index]->segment; segment != NULL; segment = segment->prev) {
+			uintptr_t from = (uintptr_t)segment;
+			uintptr_t to = (uintptr_t)(segment->reserved_end != NULL ? segment->reserved_end :
+				segment_end(segment));
+
+			if(from < start)
+				from = start;
+
+			if(to > end)
+				to = end;
+
+			if(from < to)
+				bytes += to - from;
+		}
+	}
+
+	return bytes;
+}
+
+// Gives how many bytes of the heaps the kernel has backed with huge pages, going by the
+// AnonHugePages of every mapping in /proc/self/smaps that holds a segment. Gives 0 if that can't
+// be read. It only makes system calls, so it's safe to call with the heaps locked, and the caller
+// must hold every heap's lock.
+unsigned long long heap_huge_page_bytes() {
+
+	char buffer[4096];
+	size_t filled = 0;
+	ssize_t got;
+	unsigned long long in_segments = 0, huge_bytes = 0;
+	int fd = open("/proc/self/smaps", O_RDONLY);
+
+	if(fd < 0)
+		return 0;
+
+	while((got = read(fd, buffer + filled, sizeof(buffer) - 1 - filled)) > 0) {
+		char* line = buffer;
+		char* newline;
+
+		filled += got;
+		buffer[filled] = '\0';
+
+		while((newline = strchr(line, '\n')) != NULL) {
+			*newline = '\0';
+
+			// a mapping starts with a line like "7f0e4c000000-7f0e50000000 rw-p ...", in lower case
+			// hex, and its fields follow on lines that start with a capitalized name
+			if((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f')) {
+				char* dash;
+				uintptr_t start = strtoull(line, &dash, 16);
+				uintptr_t end = *dash == '-' ? strtoull(dash + 1, NULL, 16) : start;
+
+				in_segments = bytes_in_segments(start, end);
+			} else if(strncmp(line, "AnonHugePages:", 14) == 0) {
+				unsigned long long bytes = strtoull(line + 14, NULL, 10) * 1024;
+				huge_bytes += bytes < in_segments ? bytes : in_segments;
 			}
+
+			line = newline + 1;
 		}
+
+		// keep the partial line for the next read, unless it's too long to ever finish
+		filled = strlen(line);
+
+		if(filled == sizeof(buffer) - 1)
+			filled = 0;
+
+		memmove(buffer, line, filled);
 	}
 
-	// free block of correct size not found, allocate new block
-	if(new_allocation == NULL) {
-		new_allocation = sbrk(size+BLOCK_HEADER_SIZE);
-		new_allocation->size = size;
-		new_allocation->in_use = 1;
-		link_onto_end(new_allocation);
+	close(fd);
+	return huge_bytes;
+}
+
+void my_heap_summarize(struct my_heap_summary* summary)
+{
+	unsigned int bin_index;
+
+	memset(summary, 0, sizeof(*summary));
+
+	summary->heap_bytes = walk_heaps(summarize_block, summary);
+
+	lock_all_heaps();
+	summary->huge_page_bytes = heap_huge_page_bytes();
+	unlock_all_heaps();
+
+	if(summary->free_bytes != 0)
+		summary->fragmentation = 1.0 - (double)summary->largest_free / summary->free_bytes;
+
+	summary->num_bins = NUM_BINS;
+
+	for(bin_index = 0; bin_index < NUM_BINS; bin_index++)
+		summary->bin_min_sizes[bin_index] = bin_min_size(bin_index);
+}
+
+void my_heap_summary_print()
+{
+	struct my_heap_summary summary;
+	unsigned int bin_index;
+
+	my_heap_summarize(&summary);
+
+	fprintf(stderr, "heap bytes:        %llu\n", summary.heap_bytes);
+	fprintf(stderr, "used blocks:       %u (%llu bytes)\n", summary.used_blocks,
+		summary.used_bytes);
+	fprintf(stderr, "free blocks:       %u (%llu bytes)\n", summary.free_blocks,
+		summary.free_bytes);
+	fprintf(stderr, "largest free:      %u\n", summary.largest_free);
+	fprintf(stderr, "fragmentation:     %.1f%%\n", summary.fragmentation * 100);
+	fprintf(stderr, "huge page bytes:   %llu\n", summary.huge_page_bytes);
+	fprintf(stderr, "free blocks by bin:\n");
+
+	for(bin_index = 0; bin_index < summary.num_bins; bin_index++) {
+		if(summary.free_histogram[bin_index] != 0)
+			fprintf(stderr, "  >= %8uB: %u\n", summary.bin_min_sizes[bin_index],
+				summary.free_histogram[bin_index]);
 	}
+}
 
-	return block_to_data(new_allocation);
+int my_malloc_trace_start(const char* path)
+{
+#ifndef MY_MALLOC_TRACE
+	(void)path;
+	return 0;
+#else
+	static int exit_handlers_set = 0;
+	struct my_trace_header header = {MY_TRACE_MAGIC, MY_TRACE_VERSION,
+		sizeof(struct my_trace_record)};
+	TraceBuffer* buffer;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if(trace_fd >= 0 || (trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		return 0;
+	}
+
+	write_trace(&header, sizeof(header));
+
+	// throw away anything that raced with the last my_malloc_trace_stop
+	for(buffer = trace_buffers; buffer != NULL; buffer = buffer->next)
+		atomic_store_explicit(&buffer->tail, atomic_load(&buffer->head), memory_order_release);
+
+	trace_start = monotonic_ns();
+	atomic_store_explicit(&tracing, 1, memory_order_release);
 
-	// ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+	if(!exit_handlers_set) {
+		exit_handlers_set = 1;
+		atexit(my_malloc_trace_stop);
+		pthread_atfork(NULL, NULL, stop_tracing_in_child);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	// Starting a thread allocates, so do it without the lock. Without a writer, threads still
+	// drain their own buffers when they fill up, and my_malloc_trace_stop gets the rest.
+	trace_writer_running = pthread_create(&trace_writer, NULL, run_trace_writer, NULL) == 0;
+	return 1;
+#endif
 }
 
-void my_free(void* ptr)
+void my_malloc_trace_stop()
 {
-	if(ptr == NULL)
+#ifdef MY_MALLOC_TRACE
+	if(!atomic_exchange(&tracing, 0))
 		return;
 
-	BlockHeader* block_to_free = data_to_block(ptr);
-	block_to_free = coalesce(block_to_free);
+	if(trace_writer_running)
+		pthread_join(trace_writer, NULL);
 
-	if(block_to_free->next_phys == NULL) {
-		unlink_block(); //unlink end block
-		brk(block_to_free);
-	}else{
-		block_to_free->in_use = 0;
-		insert_into_bin(block_to_free);
-	}
+	trace_writer_running = 0;
 
+	pthread_mutex_lock(&trace_lock);
+	drain_trace_buffers();
+	close(trace_fd);
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+#endif
 }
@@ -6,7 +6,235 @@ The header file for mymalloc.c
 #ifndef _MYMALLOC_H_
 #define _MYMALLOC_H_
 
+// A build can take its settings from a configuration header instead of -D flags, named with
+// -DMY_MALLOC_CONFIG='"config_server.h"' for instance, for mymalloc.c and everything built with it.
+// There's config_embedded.h for small single-threaded systems, config_server.h for multi-threaded
+// servers and config_hardened.h for the hardening checks. A setting that's also given with -D keeps
+// the -D value.
+#ifdef MY_MALLOC_CONFIG
+#include MY_MALLOC_CONFIG
+#endif
+
+// Parameters for my_mallopt, named after their glibc mallopt counterparts.
+#define MY_M_TRIM_THRESHOLD  -1 // Free top bytes allowed before my_free shrinks the heap.
+#define MY_M_TOP_PAD         -2 // Extra bytes to grow the heap by, and to keep when trimming.
+#define MY_M_GROW_CHUNK      -3 // The heap grows in multiples of this (a power of two).
+#define MY_M_MMAP_THRESHOLD  -4 // Allocations at least this big get their own mmap.
+#define MY_M_MXFAST          -5 // Freed blocks this big or smaller aren't coalesced right away.
+#define MY_M_PURGE_THRESHOLD -6 // Dirty bytes in free blocks allowed before my_free purges them.
+
 void* my_malloc(unsigned int size);
+
+// The same as my_malloc, but also puts how many bytes the block really has room for in *actual,
+// which can be more than size was. All of them can be used, by a growing buffer for instance,
+// without reallocating. *actual is 0 if it gives NULL.
+void* my_malloc_at_least(unsigned int size, unsigned int* actual);
+
+// Allocates n blocks of size bytes each and puts them in out, doing the bookkeeping once for all
+// of them. They're taken from the bin in one go or carved back to back from the top of the heap.
+// Gives how many it allocated, which is less than n if it ran out of memory.
+unsigned int my_malloc_batch(unsigned int size, unsigned int n, void** out);
+
 void my_free(void* ptr);
 
+// The same as my_free, for callers that know the size they allocated ptr with. Debug builds
+// check that it's no bigger than the block.
+void my_free_sized(void* ptr, unsigned int size);
+
+// Frees n pointers at once, under one lock (one per heap in NUMA mode). NULLs are skipped. The
+// array is sorted by address in place, so runs of neighboring blocks can be merged and binned once
+// per run instead of once per pointer.
+void my_free_batch(void** ptrs, unsigned int n);
+
+// Allocates zeroed space for nmemb objects of size bytes each. Gives NULL if nmemb * size
+// overflows. Memory fresh from the kernel is already zero, so only recycled blocks get cleared.
+void* my_calloc(unsigned int nmemb, unsigned int size);
+
+// Resizes the allocation at ptr, in place when the block's neighbors allow it, keeping the
+// contents up to the smaller of the two sizes. Acts like my_malloc if ptr is NULL, and like
+// my_free (giving NULL) if size is 0. Gives NULL and leaves ptr alone if it runs out of memory.
+void* my_realloc(void* ptr, unsigned int size);
+
+// Gives how many bytes the allocation at ptr has room for, which is at least what was asked for
+// and can all be used. Gives 0 for NULL.
+unsigned int my_malloc_usable_size(void* ptr);
+
+// Allocates size bytes at an address that's a multiple of alignment, which must be a power of two.
+// The padding in front is given back to the heap, and the result can be passed to my_free.
+// Gives NULL for a bad alignment or if it runs out of memory.
+void* my_memalign(unsigned int alignment, unsigned int size);
+
+// The same as my_memalign, named after C11's aligned_alloc.
+void* my_aligned_alloc(unsigned int alignment, unsigned int size);
+
+// The same as my_memalign, but puts the result in *memptr and gives 0 on success, EINVAL for a
+// bad alignment (it must also be a multiple of sizeof(void*)) or ENOMEM if it runs out of memory.
+int my_posix_memalign(void** memptr, unsigned int alignment, unsigned int size);
+
+// Sets one of the MY_M_* parameters. Gives 1 on success, 0 for a bad parameter or value.
+int my_mallopt(int param, int value);
+
+// Gives all but pad bytes of the free top of each heap back to the kernel right away, no matter
+// the trim threshold, along with the whole pages inside every free block. In thread-safe mode it
+// also flushes the calling thread's cache first. Gives 1 if any memory was released.
+int my_malloc_trim(unsigned int pad);
+
+// Gives back the whole pages inside the free blocks that have stayed free since the last purge,
+// and marks the rest to go next time. A block that's reused soon after it's freed keeps its pages,
+// so calling this on a timer (from any thread) gives memory back after a spike without slowing
+// down the blocks in use. Gives 1 if any memory was released.
+int my_malloc_purge();
+
+// The most sizes my_malloc_set_size_classes takes.
+#define MY_MAX_SIZE_CLASSES 14
+
+// Gives each of the n sizes a size class of its own, so the free blocks of that size are kept
+// together and a request for it takes the first one without searching. Sizes up to 512 bytes (by
+// default) have one each already, and sizes of 64 KiB or more keep the usual classes; the classes
+// in between are moved around to make room. n = 0 puts back the usual classes. Can be called at
+// any time, from any thread. Gives 1, or 0 if n is more than MY_MAX_SIZE_CLASSES.
+int my_malloc_set_size_classes(const unsigned int* sizes, unsigned int n);
+
+// Starts (on = 1) or stops (on = 0) counting the sizes of a sample of allocations, for
+// my_malloc_tune_size_classes. Starting throws away what was counted before.
+void my_malloc_sample_sizes(int on);
+
+// Gives the sizes that were at least 1% of the samples since the last call (up to
+// MY_MAX_SIZE_CLASSES of them, the most common first) classes of their own with
+// my_malloc_set_size_classes, or puts back the usual classes if none were, and clears the samples.
+// Calling it now and then keeps the classes following the traffic. Gives how many sizes got a
+// class, or 0 without changing anything if nothing was sampled.
+int my_malloc_tune_size_classes();
+
+// The most bins struct my_stats has room for.
+#define MY_STATS_BINS 128
+
+// What my_malloc_stats fills in. All the counts are since the program started.
+struct my_stats
+{
+	unsigned long long bytes_in_use;      // Usable bytes in allocated blocks.
+	unsigned long long bytes_heap;        // Bytes in heap segments, sbrk'd or mmap'd.
+	unsigned long long bytes_mmapped;     // Bytes in mmap'd blocks and slab pages.
+	unsigned long long mallocs;           // Allocations, from any of the allocating functions.
+	unsigned long long frees;
+	unsigned long long splits;            // Free blocks split to make an allocation.
+	unsigned long long coalesces;         // Free blocks merged with a neighbor.
+	unsigned long long sbrk_calls;        // Calls that grew the heap.
+	unsigned long long brk_calls;         // Calls that shrank the heap.
+	unsigned long long mmap_calls;        // Including mremaps.
+	unsigned long long munmap_calls;
+	unsigned long long overflow_searches; // Searches of the overflow tree or a geometric bin's list.
+	unsigned long long overflow_steps;    // How many blocks those searches looked at in total.
+	unsigned long long bytes_dirty;       // Bytes of whole pages in free blocks not purged yet.
+	unsigned long long purged_bytes;      // Bytes of free blocks' pages given back by purges.
+
+	// How many free blocks are in each bin, which holds blocks of bin_min_sizes[bin] bytes or more.
+	unsigned int num_bins;
+	unsigned long long bin_free_counts[MY_STATS_BINS];
+	unsigned int bin_min_sizes[MY_STATS_BINS];
+};
+
+// Fills in *stats. Each thread keeps its own counters, so this adds them up. Gives 1, or 0 (with
+// everything zeroed) if the library was built with -DMY_MALLOC_NO_STATS.
+int my_malloc_stats(struct my_stats* stats);
+
+// Prints my_malloc_stats to stderr.
+void my_malloc_stats_print();
+
+// What my_heap_walk tells its visitor about each block.
+struct my_block_info
+{
+	void* address;     // Where the block's data starts.
+	unsigned int size; // How many bytes of data it has room for.
+	int in_use;        // 1 if allocated, 0 if free.
+};
+
+// Calls visit(info, arg) on every block in the heap (every heap, one after another, if there's
+// more than one), in address order within each segment, oldest segment first. mmap'd blocks and slab pages
+// aren't part of the heap, so they're skipped. Freed blocks waiting in a fast bin or a thread
+// cache still count as in use. visit runs with the heap locked, so it mustn't call any of the
+// my_* functions.
+void my_heap_walk(void (*visit)(const struct my_block_info* info, void* arg), void* arg);
+
+// What my_heap_summarize fills in.
+struct my_heap_summary
+{
+	unsigned long long heap_bytes; // Bytes in the heap's segments, headers and fences included.
+	unsigned int used_blocks;
+	unsigned long long used_bytes;
+	unsigned int free_blocks;      // Including the free top of the heap.
+	unsigned long long free_bytes;
+	unsigned int largest_free;     // The size of the biggest free block.
+
+	// How much of the free memory is unusable for an allocation as big as it all together:
+	// 1 - largest_free / free_bytes, or 0 if nothing is free.
+	double fragmentation;
+
+	// How many bytes of the heap the kernel has backed with transparent huge pages, as far as
+	// /proc/self/smaps says. Build with -DMY_MALLOC_HUGEPAGES to ask for them.
+	unsigned long long huge_page_bytes;
+
+	// How many free blocks would go in each bin, which holds blocks of bin_min_sizes[bin] bytes
+	// or more.
+	unsigned int num_bins;
+	unsigned int free_histogram[MY_STATS_BINS];
+	unsigned int bin_min_sizes[MY_STATS_BINS];
+};
+
+// Walks the heap and fills in *summary.
+void my_heap_summarize(struct my_heap_summary* summary);
+
+// Prints my_heap_summarize to stderr.
+void my_heap_summary_print();
+
+// Starts recording every allocation and free to a new trace file at path, in the format from
+// mytrace.h. Each thread buffers its records and a background thread writes them out, so calls
+// only pay for a clock read and a copy. Only works in builds with -DMY_MALLOC_TRACE (and
+// -pthread). Gives 1 if it started, or 0 if the file can't be made, a trace is already going or
+// tracing isn't built in.
+int my_malloc_trace_start(const char* path);
+
+// Stops recording and writes out everything still buffered. A trace still going at exit is
+// stopped then; a forked child never writes to its parent's trace.
+void my_malloc_trace_stop();
+
+// An arena hands out memory by bumping a pointer through big chunks it gets from my_malloc, and
+// frees it all at once. Its allocations can't be passed to my_free or my_realloc. An arena isn't
+// thread-safe; use one per thread.
+typedef struct MyArena MyArena;
+
+// Makes an empty arena whose chunks hold chunk_size bytes, or a default size if it's 0. Gives NULL
+// if it runs out of memory.
+MyArena* my_arena_create(unsigned int chunk_size);
+
+// Allocates size bytes from the arena. Gives NULL if it runs out of memory.
+void* my_arena_alloc(MyArena* arena, unsigned int size);
+
+// Frees everything allocated from the arena, keeping one chunk around for what comes next.
+void my_arena_reset(MyArena* arena);
+
+// Frees everything allocated from the arena, and the arena itself.
+void my_arena_destroy(MyArena* arena);
+
+// A heap of its own, with its own bins, memory and lock, apart from the default heap that
+// my_malloc uses, so it can be thrown away all at once. Its blocks can also be passed to my_free
+// and my_realloc, which keeps them in their heap. Any number of threads can share one.
+typedef struct MyHeap MyHeap;
+
+// Makes an empty heap. Gives NULL if it runs out of memory, or if there are too many heaps already
+// (255 of them, counting one per node in NUMA mode).
+MyHeap* my_heap_create();
+
+// Allocates size bytes from heap. Even big allocations come from the heap itself instead of an
+// mmap of their own, and none go through the thread caches or the slabs. Gives NULL if it runs out
+// of memory.
+void* my_heap_malloc(MyHeap* heap, unsigned int size);
+
+// Frees ptr, which must have come from heap. Debug builds check that it did.
+void my_heap_free(MyHeap* heap, void* ptr);
+
+// Gives all of heap's memory back to the kernel, including whatever is still allocated from it,
+// which mustn't be used anymore. No other thread may be using the heap while it's destroyed.
+void my_heap_destroy(MyHeap* heap);
+
 #endif
@@ -0,0 +1,41 @@
+/*
+The allocation trace file format, written by my_malloc_trace_start and read by bench.c
+*/
+
+#ifndef _MYTRACE_H_
+#define _MYTRACE_H_
+
+#include <stdint.h>
+
+// "MYTRACE1", the first eight bytes of every trace file.
+#define MY_TRACE_MAGIC   0x314543415254594DULL
+#define MY_TRACE_VERSION 1
+
+// What a record is for.
+#define MY_TRACE_MALLOC  1
+#define MY_TRACE_CALLOC  2
+#define MY_TRACE_REALLOC 3
+#define MY_TRACE_FREE    4
+
+// A trace file is one of these followed by records until the end of the file.
+struct my_trace_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size; // sizeof(struct my_trace_record) when the file was written.
+};
+
+// One call. Pointers are only used to match frees and reallocs up with the allocation they're
+// for. Records from different threads can be out of order, so sort them by timestamp.
+struct my_trace_record
+{
+	uint64_t timestamp;   // Nanoseconds since the trace was started.
+	uint64_t address;     // What a malloc, calloc or realloc gave (0 if it failed), or what was freed.
+	uint64_t old_address; // What was passed to realloc. 0 for everything else.
+	uint32_t size;        // Bytes asked for, nmemb * size for calloc. 0 for free.
+	uint16_t thread;      // Which thread made the call.
+	uint8_t op;           // One of the MY_TRACE_* ops.
+	uint8_t unused;
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*
+Exports the standard malloc family on top of mymalloc.c, so unmodified programs can run on it.
+Build it as a shared library and preload it:
+
+	gcc -O2 -fPIC -shared -fvisibility=hidden -ftls-model=initial-exec \
+		-DMY_MALLOC_CONFIG='"config_server.h"' -o libmymalloc.so preload.c mymalloc.c -lpthread
+	LD_PRELOAD=./libmymalloc.so redis-server
+
+The server configuration is thread-safe and aligns every block to 16 bytes, which programs
+expect from malloc on x86-64 (it's alignof(max_align_t)) for SSE spills and long doubles. Any
+other build needs -DMY_MALLOC_THREADS and -DSIZE_MULTIPLE=16.
+
+-fvisibility=hidden keeps mymalloc.c's helpers (allocate, coalesce, ...) from taking over
+functions of the same names in other libraries; only what's marked EXPORT here is visible.
+-ftls-model=initial-exec keeps thread-local variables from being allocated on first use, which
+would call malloc from inside malloc.
+
+Nothing here needs dlsym or any setup: the heap starts out statically initialized, so the first
+malloc can come from anywhere, even the dynamic loader. Fork safety comes from mymalloc.c, which
+holds the heap lock across fork in thread-safe mode. Add -DMY_MALLOC_TRACE to the build to be
+able to record a trace of the program to the file named by the MY_MALLOC_TRACE variable.
+MY_MALLOC_SIZE_CLASSES can list sizes the program uses a lot, like "72,200,1500", to give them
+size classes of their own (see my_malloc_set_size_classes).
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mymalloc.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+// malloc has to give memory aligned for any type, and mymalloc.c aligns to 8 bytes by default.
+#if !defined(SIZE_MULTIPLE) || SIZE_MULTIPLE < 16
+#error "build with -DMY_MALLOC_CONFIG='\"config_server.h\"' or -DSIZE_MULTIPLE=16"
+#endif
+
+// The biggest request passed on to mymalloc.c, which takes unsigned int sizes. Leaves room to
+// round up and add a header without wrapping around.
+#define MAX_REQUEST (UINT_MAX - 64 * 1024)
+
+// my_malloc gives NULL for 0 bytes, but programs expect malloc(0) to give something they can free.
+unsigned int nonzero(size_t size)
+{
+	return size != 0 ? size : 1;
+}
+
+// Sets errno the way callers of the standard functions expect when ptr is NULL.
+void* check_allocation(void* ptr)
+{
+	if(ptr == NULL)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+EXPORT void* malloc(size_t size)
+{
+	if(size > MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return check_allocation(my_malloc(nonzero(size)));
+}
+
+EXPORT void free(void* ptr)
+{
+	my_free(ptr);
+}
+
+EXPORT void* calloc(size_t nmemb, size_t size)
+{
+	if(size != 0 && nmemb > MAX_REQUEST / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return check_allocation(my_calloc(1, nonzero(nmemb * size)));
+}
+
+EXPORT void* realloc(void* ptr, size_t size)
+{
+	if(ptr == NULL)
+		return malloc(size);
+
+	if(size > MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// like glibc, size 0 frees ptr and gives NULL
+	if(size == 0) {
+		my_free(ptr);
+		return NULL;
+	}
+
+	return check_allocation(my_realloc(ptr, size));
+}
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+	if(alignment > UINT_MAX)
+		return EINVAL;
+
+	if(size > MAX_REQUEST)
+		return ENOMEM;
+
+	return my_posix_memalign(memptr, alignment, nonzero(size));
+}
+
+EXPORT void* memalign(size_t alignment, size_t size)
+{
+	if(alignment > UINT_MAX || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(size > MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return check_allocation(my_memalign(alignment != 0 ? alignment : 1, nonzero(size)));
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+EXPORT void* valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void* pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if(size > MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void* ptr)
+{
+	return my_malloc_usable_size(ptr);
+}
+
+__attribute__((constructor)) void set_size_classes_from_environment()
+{
+	const char* list = getenv("MY_MALLOC_SIZE_CLASSES");
+	unsigned int sizes[MY_MAX_SIZE_CLASSES];
+	unsigned int n = 0;
+	char* end;
+
+	if(list == NULL)
+		return;
+
+	// a comma-separated list, up to the first thing that isn't a number
+	while(n < MY_MAX_SIZE_CLASSES) {
+		unsigned long size = strtoul(list, &end, 10);
+
+		if(end == list || size > UINT_MAX)
+			break;
+
+		sizes[n++] = size;
+
+		if(*end != ',')
+			break;
+
+		list = end + 1;
+	}
+
+	if(n != 0)
+		my_malloc_set_size_classes(sizes, n);
+}
+
+#ifdef MY_MALLOC_TRACE
+
+__attribute__((constructor)) void start_trace_from_environment()
+{
+	const char* path = getenv("MY_MALLOC_TRACE");
+
+	if(path != NULL && path[0] != '\0')
+		my_malloc_trace_start(path);
+}
+
+#endif